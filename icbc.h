@@ -9,12 +9,102 @@
 
 namespace icbc {
 
-    void init_dxt1();
+    // Instruction sets, same values as ICBC_USE_SPMD.
+    enum ISA {
+        ISA_NEON = -1,
+        ISA_Float = 0,
+        ISA_SSE2 = 1,
+        ISA_SSE41 = 2,
+        ISA_AVX = 3,
+        ISA_AVX2 = 4,
+        ISA_AVX512 = 5,
+        ISA_AVX512VL = 6,   // AVX-512 instructions on 256 bit registers, avoids the frequency drop of the 512 bit registers.
+                            // Not bit identical to ISA_AVX512: like ISA_AVX2 it uses the fixed point cluster fit at levels 2 to 4,
+                            // and above that its 8 lane float sums round differently from both.
+        ISA_Best = 7,
+    };
+
+    // Must be called before compressing. When the implementation is built with ICBC_DISPATCH the fastest instruction set
+    // supported by the CPU is selected, or isa if it's lower, which is useful to compare them. ISA_AVX512VL is never selected
+    // by default, only when requested and supported. Otherwise isa is ignored and ICBC_USE_SPMD is used. Returns the
+    // instruction set in use.
+    ISA init_dxt1(ISA isa = ISA_Best);
 
     float compress_dxt1(const float input_colors[16 * 4], const float input_weights[16], const float color_weights[3], bool three_color_mode, bool hq, void * output);
     float compress_dxt1_fast(const float input_colors[16 * 4], const float input_weights[16], const float color_weights[3], void * output);
     void compress_dxt1_fast(const unsigned char input_colors[16 * 4], void * output);
 
+    // Compress block_count consecutive blocks of 16 RGBA8 texels (64 bytes each) with the fast encoder, one block per SIMD lane.
+    // The output is the same as compress_dxt1_fast, except from ISA_AVX2 up where the compiler can fuse the multiply-adds of
+    // the two differently. That changes the end points of under 1% of the blocks, the error differs by less than 0.01%.
+    void compress_dxt1_fast_blocks(int block_count, const unsigned char * input_blocks, void * output);
+
+    // Each level runs the stages of the previous one plus the one listed.
+    enum Quality {
+        Quality_Level0,     // Bounding box fit.
+        Quality_Level1,     // Least squares fit.
+        Quality_Level2,     // 4 color cluster fit, merging colors into at most 8 clusters.
+        Quality_Level3,     // 4 color cluster fit, merging colors into at most 12 clusters.
+        Quality_Level4,     // Full 4 color cluster fit.
+        Quality_Level5,     // 3 color cluster fit.
+        Quality_Level6,     // Up to 8 steps of end point refinement.
+        Quality_Level7,     // Up to 16 steps of end point refinement.
+        Quality_Level8,     // Up to 256 steps of end point refinement.
+
+        Quality_Fast = Quality_Level1,
+        Quality_Default = Quality_Level5,
+        Quality_Max = Quality_Level8,
+    };
+
+    struct Options {
+        float color_weights[3] = { 1, 1, 1 };
+        Quality quality = Quality_Default;
+        bool three_color_mode = true;   // Allow 3 color blocks. These are only tried at Quality_Level5 and above.
+
+        // Skip the remaining stages as soon as the block error is at or below this value. The error is the sum of the squared
+        // differences in the [0, 255] range weighted by color_weights, as returned by compress_dxt1. For a target PSNR p use
+        // 16 * 255 * 255 / pow(10, p / 10).
+        float max_error = 0;
+
+        // Compress identical blocks only once in compress_dxt1_image. Useful for atlases and tiled images that repeat many blocks.
+        bool block_cache = false;
+    };
+
+    // Compress a block of 16 RGBA8 texels without converting it to floats. Alpha is ignored and all texels have the same weight.
+    float compress_dxt1(const unsigned char input_colors[16 * 4], const Options & options, void * output);
+
+    // Compress an RGBA8 image whose rows are row_stride bytes apart. Partial blocks along the right and bottom edges are padded
+    // by replicating the last column and row. Outputs ((width+3)/4) * ((height+3)/4) blocks in row-major order.
+    // Work is distributed with ic_pfor when ic_pfor.h is included before the implementation (see ICBC_USE_PFOR).
+    void compress_dxt1_image(int width, int height, int row_stride, const unsigned char * rgba8, const Options & options, void * output);
+
+    // Number of levels in the full mipmap chain of a width x height image, down to 1x1.
+    int mipmap_count(int width, int height);
+
+    // Number of blocks output by compress_dxt1_mipmaps.
+    int mipmap_block_count(int width, int height);
+
+    // Compress an RGBA8 image and its full mipmap chain. Each level is built from the previous one with a 2x2 box filter in
+    // strips of 16 rows, and each strip is compressed right after it is downsampled, while it is still in the cache. The levels
+    // are output one after the other, from the largest to the smallest, each one laid out as in compress_dxt1_image.
+    // Returns false, without writing any block, if the buffers for the first two mipmap levels cannot be allocated.
+    bool compress_dxt1_mipmaps(int width, int height, int row_stride, const unsigned char * rgba8, const Options & options, void * output);
+
+    // Compress a block of 16 single channel values to BC4. Returns the sum of the squared errors in the [0, 255] range.
+    float compress_bc4(const unsigned char input_values[16], void * output);
+
+    // Compress the red and green channels of a block of 16 RGBA8 texels to BC5, two BC4 blocks, red first. Returns the sum of the
+    // squared errors of both channels.
+    float compress_bc5(const unsigned char input_colors[16 * 4], void * output);
+
+    // Compress a block of 16 RGBA8 texels to BC3, a BC4 block with the alpha channel followed by a BC1 block with the color channels.
+    // The color block always uses 4 colors, options.three_color_mode is ignored. Returns the sum of the color and alpha errors.
+    float compress_bc3(const unsigned char input_colors[16 * 4], const Options & options, void * output);
+
+    // Same as compress_dxt1_image for BC4 (red channel) and BC5 (red and green channels), 8 and 16 bytes per block.
+    void compress_bc4_image(int width, int height, int row_stride, const unsigned char * rgba8, void * output);
+    void compress_bc5_image(int width, int height, int row_stride, const unsigned char * rgba8, void * output);
+
     enum Decoder {
         Decoder_D3D10 = 0,
         Decoder_NVIDIA = 1,
@@ -28,14 +118,16 @@ namespace icbc {
 #endif // ICBC_H
 
 #ifdef ICBC_IMPLEMENTATION
+#ifndef ICBC_IMPLEMENTATION_ISA
 
-// Instruction level support must be chosen at compile time setting ICBC_USE_SPMD to one of these values:
+// Instruction level support can be fixed at compile time setting ICBC_USE_SPMD to one of these values, see ICBC_DISPATCH below:
 #define ICBC_FLOAT  0
 #define ICBC_SSE2   1
 #define ICBC_SSE41  2
 #define ICBC_AVX1   3
 #define ICBC_AVX2   4
 #define ICBC_AVX512 5
+#define ICBC_AVX512VL 6
 #define ICBC_NEON   -1
 
 // AVX does not require FMA, and depending on whether it's Intel or AMD you may have FMA3 or FMA4. What a mess.
@@ -45,18 +137,18 @@ namespace icbc {
 // Apparently rcp is not deterministic (different precision on Intel and AMD), enable if you don't care about that for small performance boost.
 //#define ICBC_USE_RCP 1
 
-#ifndef ICBC_USE_SPMD
-#define ICBC_USE_SPMD 5          // SIMD version. (FLOAT=0, SSE2=1, SSE41=2, AVX1=3, AVX2=4, AVX512=5, NEON=6)
+// When ICBC_USE_SPMD is not set on x86, the implementation is compiled once for each instruction set in separate namespaces, and
+// init_dxt1 selects the fastest one supported by the CPU.
+#ifndef ICBC_DISPATCH
+#if !defined(ICBC_USE_SPMD) && (defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86))
+#define ICBC_DISPATCH 1
+#else
+#define ICBC_DISPATCH 0
 #endif
-
-#if ICBC_USE_SPMD == ICBC_AVX2
-#define ICBC_USE_AVX2_PERMUTE2 1    // Using permutevar8x32 and bitops.
-#define ICBC_USE_AVX2_PERMUTE 0     // Using blendv and permutevar8x32.
-#define ICBC_USE_AVX2_GATHER 0      // Using gathers for SAT lookup.
 #endif
 
-#if ICBC_USE_SPMD == ICBC_AVX512
-#define ICBC_USE_AVX512_PERMUTE 1
+#if !ICBC_DISPATCH && !defined(ICBC_USE_SPMD)
+#define ICBC_USE_SPMD 0          // SIMD version. (FLOAT=0, SSE2=1, SSE41=2, AVX1=3, AVX2=4, AVX512=5, AVX512VL=6, NEON=-1)
 #endif
 
 
@@ -64,6 +156,26 @@ namespace icbc {
 #define ICBC_DECODER 0       // 0 = d3d10, 1 = nvidia, 2 = amd
 #endif
 
+// Distribute compress_dxt1_image across threads using ic_pfor. Enabled by default when ic_pfor.h is included first, ic::init_pfor() must be called before compressing.
+#ifndef ICBC_USE_PFOR
+#ifdef IC_PFOR_H
+#define ICBC_USE_PFOR 1
+#else
+#define ICBC_USE_PFOR 0
+#endif
+#endif
+
+
+#if ICBC_DISPATCH
+// The intrinsics of all instruction sets are available to the functions compiled for them with the target pragmas below.
+#include <immintrin.h>
+#if _MSC_VER
+#include <zmmintrin.h>
+#include <intrin.h> // __cpuidex
+#else
+#include <cpuid.h>
+#endif
+#else // ICBC_DISPATCH
 
 #if ICBC_USE_SPMD >= ICBC_SSE2
 #include <emmintrin.h>
@@ -85,17 +197,22 @@ namespace icbc {
 #include <arm_neon.h>
 #endif
 
+#endif // ICBC_DISPATCH
+
 
 // Some testing knobs:
-#define ICBC_FAST_CLUSTER_FIT 0     // This ignores input weights for a moderate speedup. (currently broken)
+#define ICBC_FAST_CLUSTER_FIT 1     // Use precomputed least squares factors when all colors have the same weight.
 #define ICBC_PERFECT_ROUND 0        // Enable perfect rounding in scalar code path only.
 #define ICBC_USE_SAT 1              // Use summed area tables.
 
 #include <stdint.h>
 #include <stdlib.h> // abs
 #include <string.h> // memset
-#include <math.h>   // floorf
+#include <math.h>   // floorf, sqrtf
 #include <float.h>  // FLT_MAX
+#if !__GNUC__
+#include <intrin.h> // _InterlockedCompareExchange
+#endif
 
 #ifndef ICBC_ASSERT
 #if _DEBUG
@@ -141,6 +258,7 @@ typedef uint8_t uint8;
 typedef int8_t int8;
 typedef uint16_t uint16;
 typedef uint32_t uint32;
+typedef uint64_t uint64;
 typedef uint32_t uint;
 
 
@@ -164,12 +282,28 @@ struct Color32 {
     };
 };
 
+// Color in the byte order of the RGBA8 input blocks.
+struct Color8 {
+    uint8 r, g, b, a;
+};
+
 struct BlockDXT1 {
     Color16 col0;
     Color16 col1;
     uint32 indices;
 };
 
+struct BlockBC4 {
+    uint8 alpha0;
+    uint8 alpha1;
+    uint8 indices[6];   // 3 bits per texel.
+};
+
+struct BlockBC3 {
+    BlockBC4 alpha;
+    BlockDXT1 color;
+};
+
 
 struct Vector3 {
     float x;
@@ -261,6 +395,10 @@ inline float lengthSquared(Vector3 v) {
     return dot(v, v);
 }
 
+inline Vector3 cross(Vector3 a, Vector3 b) {
+    return { a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x };
+}
+
 inline bool equal(float a, float b, float epsilon = 0.0001) {
     // http://realtimecollisiondetection.net/blog/?p=89
     //return fabsf(a - b) < epsilon * max(1.0f, max(fabsf(a), fabsf(b)));
@@ -271,6 +409,40 @@ inline bool equal(Vector3 a, Vector3 b, float epsilon) {
     return equal(a.x, b.x, epsilon) && equal(a.y, b.y, epsilon) && equal(a.z, b.z, epsilon);
 }
 
+} // icbc
+
+#endif // ICBC_IMPLEMENTATION_ISA
+
+
+// Everything below, up to the public API, depends on the instruction set and is compiled once for each one of them.
+#ifdef ICBC_IMPLEMENTATION_ISA
+
+// Skipping the cluster configurations that can't beat the best error found so far only pays off without the permutes and shuffles.
+#if ICBC_USE_SPMD == ICBC_FLOAT || ICBC_USE_SPMD == ICBC_SSE2 || ICBC_USE_SPMD == ICBC_AVX1 || ICBC_USE_SPMD == ICBC_NEON
+#define ICBC_CLUSTER_FIT_PRUNING 1
+#endif
+
+#if ICBC_USE_SPMD == ICBC_SSE41
+#define ICBC_USE_SSE41_SHUFFLE 1    // Using pshufb on the bytes of the SAT.
+#endif
+
+#if ICBC_USE_SPMD == ICBC_AVX2
+#define ICBC_USE_AVX2_PERMUTE2 1    // Using permutevar8x32 and bitops.
+#define ICBC_USE_AVX2_PERMUTE 0     // Using blendv and permutevar8x32.
+#define ICBC_USE_AVX2_GATHER 1      // Using gathers for SAT lookup, when init_dxt1 finds them faster than PERMUTE2.
+#endif
+
+#if ICBC_USE_SPMD == ICBC_AVX512
+#define ICBC_USE_AVX512_PERMUTE 1
+#endif
+
+#if ICBC_USE_SPMD == ICBC_AVX512VL
+#define ICBC_USE_AVX512VL_PERMUTE 1     // Using the two table permutex2var.
+#endif
+
+namespace icbc {
+namespace ICBC_NAMESPACE {
+
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 // SPMD
@@ -283,6 +455,15 @@ inline bool equal(Vector3 a, Vector3 b, float epsilon) {
 #endif
 #endif
 
+// Data loaded with vload must be aligned to the widest vector size.
+#ifndef ICBC_ALIGN_64
+#if __GNUC__
+#   define ICBC_ALIGN_64 __attribute__ ((__aligned__ (64)))
+#else // _MSC_VER
+#   define ICBC_ALIGN_64 __declspec(align(64))
+#endif
+#endif
+
 #if __GNUC__
 #define ICBC_FORCEINLINE inline __attribute__((always_inline))
 #else
@@ -296,19 +477,28 @@ inline bool equal(Vector3 a, Vector3 b, float epsilon) {
 using VFloat = float;
 using VMask = bool;
 
-ICBC_FORCEINLINE float & lane(VFloat & v, int i) { return v; }
+ICBC_FORCEINLINE float & lane(VFloat & v, int /*i*/) { return v; }
 ICBC_FORCEINLINE VFloat vzero() { return 0.0f; }
 ICBC_FORCEINLINE VFloat vbroadcast(float x) { return x; }
 ICBC_FORCEINLINE VFloat vload(const float * ptr) { return *ptr; }
+ICBC_FORCEINLINE void vstore(float * ptr, VFloat v) { *ptr = v; }
 ICBC_FORCEINLINE VFloat vrcp(VFloat a) { return 1.0f / a; }
 ICBC_FORCEINLINE VFloat vmad(VFloat a, VFloat b, VFloat c) { return a * b + c; }
 ICBC_FORCEINLINE VFloat vsaturate(VFloat a) { return min(max(a, 0.0f), 1.0f); }
 ICBC_FORCEINLINE VFloat vround(VFloat a) { return float(int(a + 0.5f)); }
+ICBC_FORCEINLINE VFloat vtruncate(VFloat a) { return float(int(a)); }
+ICBC_FORCEINLINE VFloat vmin(VFloat a, VFloat b) { return min(a, b); }
+ICBC_FORCEINLINE VFloat vmax(VFloat a, VFloat b) { return max(a, b); }
 ICBC_FORCEINLINE VFloat lane_id() { return 0; }
 ICBC_FORCEINLINE VFloat vselect(VMask mask, VFloat a, VFloat b) { return mask ? b : a; }
 ICBC_FORCEINLINE bool all(VMask m) { return m; }
 ICBC_FORCEINLINE bool any(VMask m) { return m; }
 
+// One bit per lane.
+ICBC_FORCEINLINE uint mask_bits(VMask m) { return m ? 1 : 0; }
+ICBC_FORCEINLINE VMask vmask(uint bits) { return (bits & 1) != 0; }
+ICBC_FORCEINLINE float vreduce_add(VFloat v) { return v; }
+
 
 #elif ICBC_USE_SPMD == ICBC_SSE2 || ICBC_USE_SPMD == ICBC_SSE41
 
@@ -351,6 +541,10 @@ ICBC_FORCEINLINE VFloat vload(const float * ptr) {
     return _mm_load_ps(ptr);
 }
 
+ICBC_FORCEINLINE void vstore(float * ptr, VFloat v) {
+    _mm_store_ps(ptr, v);
+}
+
 ICBC_FORCEINLINE VFloat operator+(VFloat a, VFloat b) {
     return _mm_add_ps(a, b);
 }
@@ -400,6 +594,14 @@ ICBC_FORCEINLINE VFloat vtruncate(VFloat a) {
 #endif
 }
 
+ICBC_FORCEINLINE VFloat vmin(VFloat a, VFloat b) {
+    return _mm_min_ps(a, b);
+}
+
+ICBC_FORCEINLINE VFloat vmax(VFloat a, VFloat b) {
+    return _mm_max_ps(a, b);
+}
+
 ICBC_FORCEINLINE VFloat lane_id() {
     return _mm_set_ps(3, 2, 1, 0);
 }
@@ -408,6 +610,7 @@ ICBC_FORCEINLINE VMask operator> (VFloat A, VFloat B) { return _mm_cmpgt_ps(A, B
 ICBC_FORCEINLINE VMask operator>=(VFloat A, VFloat B) { return _mm_cmpge_ps(A, B); }
 ICBC_FORCEINLINE VMask operator< (VFloat A, VFloat B) { return _mm_cmplt_ps(A, B); }
 ICBC_FORCEINLINE VMask operator<=(VFloat A, VFloat B) { return _mm_cmple_ps(A, B); }
+ICBC_FORCEINLINE VMask operator==(VFloat A, VFloat B) { return _mm_cmpeq_ps(A, B); }
 
 ICBC_FORCEINLINE VMask operator| (VMask A, VMask B) { return _mm_or_ps(A, B); }
 ICBC_FORCEINLINE VMask operator& (VMask A, VMask B) { return _mm_and_ps(A, B); }
@@ -432,6 +635,23 @@ ICBC_FORCEINLINE bool any(VMask m) {
     return value != 0;
 }
 
+ICBC_FORCEINLINE uint mask_bits(VMask m) {
+    return uint(_mm_movemask_ps(m));
+}
+
+// Inverse of mask_bits, lane i is set when bit i is set.
+ICBC_FORCEINLINE VMask vmask(uint bits) {
+    const __m128i lane_bits = _mm_setr_epi32(1, 2, 4, 8);
+    __m128i b = _mm_and_si128(_mm_set1_epi32(int(bits)), lane_bits);
+    return _mm_castsi128_ps(_mm_cmpeq_epi32(b, lane_bits));
+}
+
+ICBC_FORCEINLINE float vreduce_add(VFloat v) {
+    __m128 t = _mm_add_ps(v, _mm_movehl_ps(v, v));
+    t = _mm_add_ss(t, _mm_shuffle_ps(t, t, 1));
+    return _mm_cvtss_f32(t);
+}
+
 
 #elif ICBC_USE_SPMD == ICBC_AVX1 || ICBC_USE_SPMD == ICBC_AVX2
 
@@ -474,6 +694,10 @@ ICBC_FORCEINLINE VFloat vload(const float * ptr) {
     return _mm256_load_ps(ptr);
 }
 
+ICBC_FORCEINLINE void vstore(float * ptr, VFloat v) {
+    _mm256_store_ps(ptr, v);
+}
+
 ICBC_FORCEINLINE VFloat operator+(VFloat a, VFloat b) {
     return _mm256_add_ps(a, b);
 }
@@ -517,6 +741,18 @@ ICBC_FORCEINLINE VFloat vround(VFloat a) {
     return _mm256_round_ps(a, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
 }
 
+ICBC_FORCEINLINE VFloat vtruncate(VFloat a) {
+    return _mm256_round_ps(a, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+}
+
+ICBC_FORCEINLINE VFloat vmin(VFloat a, VFloat b) {
+    return _mm256_min_ps(a, b);
+}
+
+ICBC_FORCEINLINE VFloat vmax(VFloat a, VFloat b) {
+    return _mm256_max_ps(a, b);
+}
+
 ICBC_FORCEINLINE VFloat lane_id() {
     return _mm256_set_ps(7, 6, 5, 4, 3, 2, 1, 0);
 }
@@ -525,6 +761,7 @@ ICBC_FORCEINLINE VMask operator> (VFloat A, VFloat B) { return _mm256_cmp_ps(A,
 ICBC_FORCEINLINE VMask operator>=(VFloat A, VFloat B) { return _mm256_cmp_ps(A, B, _CMP_GE_OQ); }
 ICBC_FORCEINLINE VMask operator< (VFloat A, VFloat B) { return _mm256_cmp_ps(A, B, _CMP_LT_OQ); }
 ICBC_FORCEINLINE VMask operator<=(VFloat A, VFloat B) { return _mm256_cmp_ps(A, B, _CMP_LE_OQ); }
+ICBC_FORCEINLINE VMask operator==(VFloat A, VFloat B) { return _mm256_cmp_ps(A, B, _CMP_EQ_OQ); }
 
 ICBC_FORCEINLINE VMask operator| (VMask A, VMask B) { return _mm256_or_ps(A, B); }
 ICBC_FORCEINLINE VMask operator& (VMask A, VMask B) { return _mm256_and_ps(A, B); }
@@ -532,7 +769,12 @@ ICBC_FORCEINLINE VMask operator^ (VMask A, VMask B) { return _mm256_xor_ps(A, B)
 
 // mask ? b : a
 ICBC_FORCEINLINE VFloat vselect(VMask mask, VFloat a, VFloat b) {
+#if ICBC_USE_SPMD == ICBC_AVX1
+    // GCC splits blendv into per lane branches when it can't use AVX2 integer ops.
+    return _mm256_or_ps(_mm256_andnot_ps(mask, a), _mm256_and_ps(mask, b));
+#else
     return _mm256_blendv_ps(a, b, mask);
+#endif
 }
 
 ICBC_FORCEINLINE bool all(VMask m) {
@@ -544,6 +786,31 @@ ICBC_FORCEINLINE bool any(VMask m) {
     return _mm256_testz_ps(m, m) == 0;
 }
 
+ICBC_FORCEINLINE uint mask_bits(VMask m) {
+    return uint(_mm256_movemask_ps(m));
+}
+
+// Inverse of mask_bits, lane i is set when bit i is set.
+ICBC_FORCEINLINE VMask vmask(uint bits) {
+#if ICBC_USE_SPMD == ICBC_AVX2
+    const __m256i lane_bits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+    __m256i b = _mm256_and_si256(_mm256_set1_epi32(int(bits)), lane_bits);
+    return _mm256_castsi256_ps(_mm256_cmpeq_epi32(b, lane_bits));
+#else
+    // AVX1 has no 256 bit integer compares, convert the isolated bits to float instead.
+    const __m256 lane_bits = _mm256_castsi256_ps(_mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128));
+    __m256 b = _mm256_and_ps(_mm256_castsi256_ps(_mm256_set1_epi32(int(bits))), lane_bits);
+    return _mm256_cmp_ps(_mm256_cvtepi32_ps(_mm256_castps_si256(b)), _mm256_setzero_ps(), _CMP_NEQ_OQ);
+#endif
+}
+
+ICBC_FORCEINLINE float vreduce_add(VFloat v) {
+    __m128 t = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    t = _mm_add_ps(t, _mm_movehl_ps(t, t));
+    t = _mm_add_ss(t, _mm_shuffle_ps(t, t, 1));
+    return _mm_cvtss_f32(t);
+}
+
 
 #elif ICBC_USE_SPMD == ICBC_AVX512
 
@@ -579,6 +846,10 @@ ICBC_FORCEINLINE VFloat vload(const float * ptr) {
     return _mm512_load_ps(ptr);
 }
 
+ICBC_FORCEINLINE void vstore(float * ptr, VFloat v) {
+    _mm512_store_ps(ptr, v);
+}
+
 ICBC_FORCEINLINE VFloat vload(VMask mask, const float * ptr) {
     return _mm512_mask_load_ps(_mm512_undefined(), mask.m, ptr);
 }
@@ -619,6 +890,18 @@ ICBC_FORCEINLINE VFloat vround(VFloat a) {
     return _mm512_roundscale_ps(a, _MM_FROUND_TO_NEAREST_INT);
 }
 
+ICBC_FORCEINLINE VFloat vtruncate(VFloat a) {
+    return _mm512_roundscale_ps(a, _MM_FROUND_TO_ZERO);
+}
+
+ICBC_FORCEINLINE VFloat vmin(VFloat a, VFloat b) {
+    return _mm512_min_ps(a, b);
+}
+
+ICBC_FORCEINLINE VFloat vmax(VFloat a, VFloat b) {
+    return _mm512_max_ps(a, b);
+}
+
 ICBC_FORCEINLINE VFloat lane_id() {
     return _mm512_set_ps(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
 }
@@ -627,6 +910,7 @@ ICBC_FORCEINLINE VMask operator> (VFloat A, VFloat B) { return { _mm512_cmp_ps_m
 ICBC_FORCEINLINE VMask operator>=(VFloat A, VFloat B) { return { _mm512_cmp_ps_mask(A, B, _CMP_GE_OQ) }; }
 ICBC_FORCEINLINE VMask operator< (VFloat A, VFloat B) { return { _mm512_cmp_ps_mask(A, B, _CMP_LT_OQ) }; }
 ICBC_FORCEINLINE VMask operator<=(VFloat A, VFloat B) { return { _mm512_cmp_ps_mask(A, B, _CMP_LE_OQ) }; }
+ICBC_FORCEINLINE VMask operator==(VFloat A, VFloat B) { return { _mm512_cmp_ps_mask(A, B, _CMP_EQ_OQ) }; }
 
 ICBC_FORCEINLINE VMask operator! (VMask A) { return { _mm512_knot(A.m) }; }
 ICBC_FORCEINLINE VMask operator| (VMask A, VMask B) { return { _mm512_kor(A.m, B.m) }; }
@@ -646,6 +930,161 @@ ICBC_FORCEINLINE bool any(VMask mask) {
     return mask.m != 0;
 }
 
+ICBC_FORCEINLINE uint mask_bits(VMask mask) {
+    return uint(mask.m);
+}
+
+ICBC_FORCEINLINE VMask vmask(uint bits) {
+    return { __mmask16(bits) };
+}
+
+// Same as _mm512_reduce_add_ps, but in GCC 12 that and the 512 bit extracts pass an undefined vector that warns as uninitialized.
+// The halves are added from memory instead, which compiles to the same extract.
+ICBC_FORCEINLINE float vreduce_add(VFloat v) {
+    ICBC_ALIGN_64 float tmp[16];
+    _mm512_store_ps(tmp, v);
+    __m256 h = _mm256_add_ps(_mm256_load_ps(tmp), _mm256_load_ps(tmp + 8));
+    __m128 t = _mm_add_ps(_mm256_castps256_ps128(h), _mm256_extractf128_ps(h, 1));
+    t = _mm_add_ps(t, _mm_movehl_ps(t, t));
+    t = _mm_add_ss(t, _mm_shuffle_ps(t, t, 1));
+    return _mm_cvtss_f32(t);
+}
+
+#elif ICBC_USE_SPMD == ICBC_AVX512VL
+
+// AVX-512 masks and permutes on 256 bit registers. Some CPUs lower their clock frequency when using 512 bit registers, which
+// slows down any other code running on the same core.
+#define VEC_SIZE 8
+
+#if __GNUC__
+union VFloat {
+    __m256 v;
+    float m256_f32[VEC_SIZE];
+
+    VFloat() {}
+    VFloat(__m256 v) : v(v) {}
+    operator __m256 & () { return v; }
+};
+#else
+using VFloat = __m256;
+#endif
+struct VMask { __mmask8 m; };
+
+ICBC_FORCEINLINE float & lane(VFloat & v, int i) {
+    return v.m256_f32[i];
+}
+
+ICBC_FORCEINLINE VFloat vzero() {
+    return _mm256_setzero_ps();
+}
+
+ICBC_FORCEINLINE VFloat vbroadcast(float a) {
+    return _mm256_set1_ps(a);
+}
+
+ICBC_FORCEINLINE VFloat vload(const float * ptr) {
+    return _mm256_load_ps(ptr);
+}
+
+ICBC_FORCEINLINE void vstore(float * ptr, VFloat v) {
+    _mm256_store_ps(ptr, v);
+}
+
+ICBC_FORCEINLINE VFloat vload(VMask mask, const float * ptr) {
+    return _mm256_maskz_load_ps(mask.m, ptr);
+}
+
+ICBC_FORCEINLINE VFloat vload(VMask mask, const float * ptr, float fallback) {
+    return _mm256_mask_load_ps(_mm256_set1_ps(fallback), mask.m, ptr);
+}
+
+ICBC_FORCEINLINE VFloat operator+(VFloat a, VFloat b) {
+    return _mm256_add_ps(a, b);
+}
+
+ICBC_FORCEINLINE VFloat operator-(VFloat a, VFloat b) {
+    return _mm256_sub_ps(a, b);
+}
+
+ICBC_FORCEINLINE VFloat operator*(VFloat a, VFloat b) {
+    return _mm256_mul_ps(a, b);
+}
+
+ICBC_FORCEINLINE VFloat vrcp(VFloat a) {
+    return _mm256_div_ps(vbroadcast(1.0f), a);
+}
+
+// a*b+c
+ICBC_FORCEINLINE VFloat vmad(VFloat a, VFloat b, VFloat c) {
+    return _mm256_fmadd_ps(a, b, c);
+}
+
+ICBC_FORCEINLINE VFloat vsaturate(VFloat a) {
+    auto zero = _mm256_setzero_ps();
+    auto one = _mm256_set1_ps(1.0f);
+    return _mm256_min_ps(_mm256_max_ps(a, zero), one);
+}
+
+ICBC_FORCEINLINE VFloat vround(VFloat a) {
+    return _mm256_roundscale_ps(a, _MM_FROUND_TO_NEAREST_INT);
+}
+
+ICBC_FORCEINLINE VFloat vtruncate(VFloat a) {
+    return _mm256_roundscale_ps(a, _MM_FROUND_TO_ZERO);
+}
+
+ICBC_FORCEINLINE VFloat vmin(VFloat a, VFloat b) {
+    return _mm256_min_ps(a, b);
+}
+
+ICBC_FORCEINLINE VFloat vmax(VFloat a, VFloat b) {
+    return _mm256_max_ps(a, b);
+}
+
+ICBC_FORCEINLINE VFloat lane_id() {
+    return _mm256_set_ps(7, 6, 5, 4, 3, 2, 1, 0);
+}
+
+ICBC_FORCEINLINE VMask operator> (VFloat A, VFloat B) { return { _mm256_cmp_ps_mask(A, B, _CMP_GT_OQ) }; }
+ICBC_FORCEINLINE VMask operator>=(VFloat A, VFloat B) { return { _mm256_cmp_ps_mask(A, B, _CMP_GE_OQ) }; }
+ICBC_FORCEINLINE VMask operator< (VFloat A, VFloat B) { return { _mm256_cmp_ps_mask(A, B, _CMP_LT_OQ) }; }
+ICBC_FORCEINLINE VMask operator<=(VFloat A, VFloat B) { return { _mm256_cmp_ps_mask(A, B, _CMP_LE_OQ) }; }
+ICBC_FORCEINLINE VMask operator==(VFloat A, VFloat B) { return { _mm256_cmp_ps_mask(A, B, _CMP_EQ_OQ) }; }
+
+// The 8 bit mask instructions require AVX512DQ, let the compiler choose.
+ICBC_FORCEINLINE VMask operator! (VMask A) { return { __mmask8(~A.m) }; }
+ICBC_FORCEINLINE VMask operator| (VMask A, VMask B) { return { __mmask8(A.m | B.m) }; }
+ICBC_FORCEINLINE VMask operator& (VMask A, VMask B) { return { __mmask8(A.m & B.m) }; }
+ICBC_FORCEINLINE VMask operator^ (VMask A, VMask B) { return { __mmask8(A.m ^ B.m) }; }
+
+// mask ? b : a
+ICBC_FORCEINLINE VFloat vselect(VMask mask, VFloat a, VFloat b) {
+    return _mm256_mask_blend_ps(mask.m, a, b);
+}
+
+ICBC_FORCEINLINE bool all(VMask mask) {
+    return mask.m == 0xFF;
+}
+
+ICBC_FORCEINLINE bool any(VMask mask) {
+    return mask.m != 0;
+}
+
+ICBC_FORCEINLINE uint mask_bits(VMask mask) {
+    return uint(mask.m);
+}
+
+ICBC_FORCEINLINE VMask vmask(uint bits) {
+    return { __mmask8(bits) };
+}
+
+ICBC_FORCEINLINE float vreduce_add(VFloat v) {
+    __m128 t = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    t = _mm_add_ps(t, _mm_movehl_ps(t, t));
+    t = _mm_add_ss(t, _mm_shuffle_ps(t, t, 1));
+    return _mm_cvtss_f32(t);
+}
+
 #elif ICBC_USE_SPMD == ICBC_NEON
 
 #define VEC_SIZE 4
@@ -669,6 +1108,10 @@ ICBC_FORCEINLINE VFloat vload(const float * ptr) {
     // @@
 }
 
+ICBC_FORCEINLINE void vstore(float * ptr, VFloat v) {
+    vst1q_f32(ptr, v);
+}
+
 ICBC_FORCEINLINE VFloat operator+(VFloat a, VFloat b) {
     return vaddq_f32(a, b);
 }
@@ -702,6 +1145,18 @@ ICBC_FORCEINLINE VFloat vround(VFloat a) {
     return vrndq_f32(a);
 }
 
+ICBC_FORCEINLINE VFloat vtruncate(VFloat a) {
+    return vcvtq_f32_s32(vcvtq_s32_f32(a));
+}
+
+ICBC_FORCEINLINE VFloat vmin(VFloat a, VFloat b) {
+    return vminq_f32(a, b);
+}
+
+ICBC_FORCEINLINE VFloat vmax(VFloat a, VFloat b) {
+    return vmaxq_f32(a, b);
+}
+
 ICBC_FORCEINLINE VFloat lane_id() {
     // @@
 }
@@ -710,6 +1165,7 @@ ICBC_FORCEINLINE VMask operator> (VFloat A, VFloat B) { return { _mm512_cmp_ps_m
 ICBC_FORCEINLINE VMask operator>=(VFloat A, VFloat B) { return { _mm512_cmp_ps_mask(A, B, _CMP_GE_OQ) }; }
 ICBC_FORCEINLINE VMask operator< (VFloat A, VFloat B) { return { _mm512_cmp_ps_mask(A, B, _CMP_LT_OQ) }; }
 ICBC_FORCEINLINE VMask operator<=(VFloat A, VFloat B) { return { _mm512_cmp_ps_mask(A, B, _CMP_LE_OQ) }; }
+ICBC_FORCEINLINE VMask operator==(VFloat A, VFloat B) { return vceqq_f32(A, B); }
 
 ICBC_FORCEINLINE VMask operator! (VMask A) { return { _mm512_knot(A.m) }; }
 ICBC_FORCEINLINE VMask operator| (VMask A, VMask B) { return { _mm512_kor(A.m, B.m) }; }
@@ -729,9 +1185,21 @@ ICBC_FORCEINLINE bool any(VMask mask) {
     // @@
 }
 
-#endif // ICBC_NEON
+ICBC_FORCEINLINE uint mask_bits(VMask mask) {
+    uint32x4_t bits = vshrq_n_u32(mask, 31);
+    return vgetq_lane_u32(bits, 0) | (vgetq_lane_u32(bits, 1) << 1) | (vgetq_lane_u32(bits, 2) << 2) | (vgetq_lane_u32(bits, 3) << 3);
+}
+
+ICBC_FORCEINLINE VMask vmask(uint bits) {
+    const uint32x4_t lane_bits = { 1, 2, 4, 8 };
+    return vtstq_u32(vdupq_n_u32(bits), lane_bits);
+}
+
+ICBC_FORCEINLINE float vreduce_add(VFloat v) {
+    return vaddvq_f32(v);
+}
 
-#if ICBC_USE_SPMD
+#endif // ICBC_NEON
 
 struct VVector3 {
     VFloat x;
@@ -866,7 +1334,21 @@ ICBC_FORCEINLINE VVector3 vselect(VMask mask, VVector3 a, VVector3 b) {
     return r;
 }
 
-#endif // ICBC_USE_SPMD
+ICBC_FORCEINLINE VVector3 vmin(VVector3 a, VVector3 b) {
+    VVector3 r;
+    r.x = vmin(a.x, b.x);
+    r.y = vmin(a.y, b.y);
+    r.z = vmin(a.z, b.z);
+    return r;
+}
+
+ICBC_FORCEINLINE VVector3 vmax(VVector3 a, VVector3 b) {
+    VVector3 r;
+    r.x = vmax(a.x, b.x);
+    r.y = vmax(a.y, b.y);
+    r.z = vmax(a.z, b.z);
+    return r;
+}
 
 
 
@@ -936,6 +1418,10 @@ inline Vector3 color_to_vector3(Color32 c) {
     return { c.r / 255.0f, c.g / 255.0f, c.b / 255.0f };
 }
 
+inline Vector3 color_to_vector3(Color8 c) {
+    return { c.r / 255.0f, c.g / 255.0f, c.b / 255.0f };
+}
+
 inline Color32 vector3_to_color32(Vector3 v) {
     Color32 color;
     color.r = uint8(saturate(v.x) * 255 + 0.5f);
@@ -957,53 +1443,213 @@ inline bool is_black(Vector3 c) {
     return c.x < 1.0f / 8 && c.y < 1.0f / 8 && c.z < 1.0f / 8;
 }
 
-// Find similar colors and combine them together.
-static int reduce_colors(const Vector4 * input_colors, const float * input_weights, int count, Vector3 * colors, float * weights, bool * any_black)
+// Returns true when all the texels of the RGBA8 block have the same color, alpha is ignored. The 64 bytes of the block are
+// compared against the first texel without converting them to floats.
+static bool is_single_color_rgba8(const uint8 input_colors[16 * 4])
 {
-#if 0
-    for (int i = 0; i < 16; i++) {
-        colors[i] = input_colors[i].xyz;
-        weights[i] = input_weights[i];
+    uint32 first;
+    memcpy(&first, input_colors, 4);
+
+#if ICBC_USE_SPMD >= ICBC_AVX2
+    const __m256i mask = _mm256_set1_epi32(0x00FFFFFF);
+    const __m256i c = _mm256_and_si256(_mm256_set1_epi32(int(first)), mask);
+    __m256i a = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)input_colors + 0), mask);
+    __m256i b = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)input_colors + 1), mask);
+    __m256i eq = _mm256_and_si256(_mm256_cmpeq_epi32(a, c), _mm256_cmpeq_epi32(b, c));
+    return _mm256_movemask_epi8(eq) == -1;
+#elif ICBC_USE_SPMD >= ICBC_SSE2
+    const __m128i mask = _mm_set1_epi32(0x00FFFFFF);
+    const __m128i c = _mm_and_si128(_mm_set1_epi32(int(first)), mask);
+    __m128i eq = _mm_set1_epi32(-1);
+    for (int i = 0; i < 4; i++) {
+        __m128i a = _mm_and_si128(_mm_loadu_si128((const __m128i *)input_colors + i), mask);
+        eq = _mm_and_si128(eq, _mm_cmpeq_epi32(a, c));
     }
-    return 16;
+    return _mm_movemask_epi8(eq) == 0xFFFF;
 #else
-    *any_black = false;
-
-    int n = 0;
-    for (int i = 0; i < count; i++)
-    {
-        Vector3 ci = input_colors[i].xyz;
-        float wi = input_weights[i];
+    for (int i = 1; i < 16; i++) {
+        uint32 texel;
+        memcpy(&texel, input_colors + 4 * i, 4);
+        if ((texel ^ first) & 0x00FFFFFF) return false;
+    }
+    return true;
+#endif
+}
 
-        if (wi > 0) {
-            const float threshold = 1.0f / 256;
+// Colors are deduplicated with an all pairs comparison of 24 bit keys, which are exact in float. The comparison matrix is
+// evaluated one column at a time over VEC_SIZE rows, and the weights of the matching texels are accumulated with the column
+// masks in input order. The matrix is symmetric, so the bit masks of the columns are also the rows, and a texel is the first
+// occurrence of its color when its row has no lower bits set. Texels with zero weight have unique negative keys.
+static int compact_color_keys(const float keys[16], const float input_weights[16], int count, int first[16], float weights[16])
+{
+#if ICBC_USE_SPMD == ICBC_FLOAT
+    // Without SIMD lanes it's faster to only compare against the unique colors found so far.
+    float unique_keys[16];
 
-            // Find matching color.
-            int j;
-            for (j = 0; j < n; j++) {
-                if (equal(colors[j], ci, threshold)) {
-                    weights[j] += wi;
-                    break;
-                }
+    int n = 0;
+    for (int i = 0; i < count; i++) {
+        const float key = keys[i];
+        if (key < 0) continue;
+
+        int j;
+        for (j = 0; j < n; j++) {
+            if (unique_keys[j] == key) {
+                weights[j] += input_weights[i];
+                break;
             }
+        }
+        if (j == n) {
+            unique_keys[n] = key;
+            first[n] = i;
+            weights[n] = input_weights[i];
+            n++;
+        }
+    }
+    return n;
+#else
+    uint masks[16] = { 0 };
+    float sums[16];
 
-            // No match found. Add new color.
-            if (j == n) {
-                colors[n] = ci;
-                weights[n] = wi;
-                n++;
-            }
+    for (int i = 0; i < 16; i += VEC_SIZE) {
+        const VFloat vkeys = vload(keys + i);
 
-            if (is_black(ci)) {
-                *any_black = true;
-            }
+        VFloat sum = vzero();
+        for (int j = 0; j < count; j++) {
+            VMask eq = vkeys == vbroadcast(keys[j]);
+            sum = sum + vselect(eq, vzero(), vbroadcast(input_weights[j]));
+            masks[j] |= mask_bits(eq) << i;
+        }
+
+        for (int k = 0; k < VEC_SIZE; k++) {
+            sums[i + k] = lane(sum, k);
         }
     }
 
+    // Branch free compaction.
+    int n = 0;
+    for (int i = 0; i < count; i++) {
+        first[n] = i;
+        weights[n] = sums[i];
+        n += int(keys[i] >= 0) & int((masks[i] & ((1U << i) - 1)) == 0);
+    }
+    return n;
+#endif
+}
+
+// Loads the 24 bit keys of the colors quantized to 8 bits, and returns a bit mask of the black texels.
+static uint load_color_keys(const Vector4 input_colors[16], float keys[16])
+{
+    uint black = 0;
+
+#if ICBC_USE_SPMD >= ICBC_SSE2
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 scale = _mm_set1_ps(255.0f);
+    const __m128 half = _mm_set1_ps(0.5f);
+    const __m128 threshold = _mm_set1_ps(1.0f / 8);
+    for (int i = 0; i < 16; i += 4) {
+        __m128 r = _mm_loadu_ps(&input_colors[i + 0].x);
+        __m128 g = _mm_loadu_ps(&input_colors[i + 1].x);
+        __m128 b = _mm_loadu_ps(&input_colors[i + 2].x);
+        __m128 a = _mm_loadu_ps(&input_colors[i + 3].x);
+        _MM_TRANSPOSE4_PS(r, g, b, a);
+
+        // Same as is_black(c.xyz).
+        __m128 is_black = _mm_and_ps(_mm_and_ps(_mm_cmplt_ps(r, threshold), _mm_cmplt_ps(g, threshold)), _mm_cmplt_ps(b, threshold));
+        black |= uint(_mm_movemask_ps(is_black)) << i;
+
+        // Same as vector3_to_color32(c.xyz).
+        __m128i ri = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(_mm_min_ps(_mm_max_ps(r, zero), one), scale), half));
+        __m128i gi = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(_mm_min_ps(_mm_max_ps(g, zero), one), scale), half));
+        __m128i bi = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(_mm_min_ps(_mm_max_ps(b, zero), one), scale), half));
+        __m128i key = _mm_or_si128(ri, _mm_or_si128(_mm_slli_epi32(gi, 8), _mm_slli_epi32(bi, 16)));
+        _mm_store_ps(keys + i, _mm_cvtepi32_ps(key));
+    }
+#else
+    for (int i = 0; i < 16; i++) {
+        Color32 c = vector3_to_color32(input_colors[i].xyz);
+        keys[i] = float(c.r | (c.g << 8) | (c.b << 16));
+        black |= uint(is_black(input_colors[i].xyz)) << i;
+    }
+#endif
+
+    return black;
+}
+
+// Same for 8 bit colors, the black texels are the ones with all components below 32.
+static uint load_color_keys(const Color8 input_colors[16], float keys[16])
+{
+    uint black = 0;
+
+#if ICBC_USE_SPMD >= ICBC_AVX2
+    const __m256i mask = _mm256_set1_epi32(0x00FFFFFF);
+    const __m256i high_bits = _mm256_set1_epi32(0x00E0E0E0);
+    for (int i = 0; i < 16; i += 8) {
+        __m256i c = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(input_colors + i)), mask);
+        _mm256_store_ps(keys + i, _mm256_cvtepi32_ps(c));
+        __m256i b = _mm256_cmpeq_epi32(_mm256_and_si256(c, high_bits), _mm256_setzero_si256());
+        black |= uint(_mm256_movemask_ps(_mm256_castsi256_ps(b))) << i;
+    }
+#elif ICBC_USE_SPMD >= ICBC_SSE2
+    const __m128i mask = _mm_set1_epi32(0x00FFFFFF);
+    const __m128i high_bits = _mm_set1_epi32(0x00E0E0E0);
+    for (int i = 0; i < 16; i += 4) {
+        __m128i c = _mm_and_si128(_mm_loadu_si128((const __m128i *)(input_colors + i)), mask);
+        _mm_store_ps(keys + i, _mm_cvtepi32_ps(c));
+        __m128i b = _mm_cmpeq_epi32(_mm_and_si128(c, high_bits), _mm_setzero_si128());
+        black |= uint(_mm_movemask_ps(_mm_castsi128_ps(b))) << i;
+    }
+#else
+    for (int i = 0; i < 16; i++) {
+        uint32 c;
+        memcpy(&c, input_colors + i, 4);
+        c &= 0x00FFFFFF;
+        keys[i] = float(c);
+        black |= uint((c & 0x00E0E0E0) == 0) << i;
+    }
+#endif
+
+    return black;
+}
+
+// Same as color_to_vector3, without the divisions.
+static float s_unorm8_to_float[256];
+
+inline Vector3 unique_color(const Vector4 * input_colors, int i) {
+    return input_colors[i].xyz;
+}
+inline Vector3 unique_color(const Color8 * input_colors, int i) {
+    Color8 c = input_colors[i];
+    return { s_unorm8_to_float[c.r], s_unorm8_to_float[c.g], s_unorm8_to_float[c.b] };
+}
+
+// Merges the texels with the same color, accumulating their weights, and skips the texels with zero weight. Float colors are
+// quantized to 8 bits first, so colors that round to the same 8 bit value are merged. The unique colors are in the order of
+// their first occurrence.
+template <typename InputColor>
+static int reduce_colors(const InputColor * input_colors, const float * input_weights, int count, Vector3 * colors, float * weights, bool * any_black)
+{
+    ICBC_ALIGN_64 float keys[16];
+    uint black = load_color_keys(input_colors, keys);
+
+    uint valid = 0;
+    for (int i = 0; i < 16; i++) {
+        bool v = i < count && input_weights[i] > 0;
+        keys[i] = v ? keys[i] : float(-1 - i);
+        valid |= uint(v) << i;
+    }
+    *any_black = (black & valid) != 0;
+
+    int first[16];
+    int n = compact_color_keys(keys, input_weights, count, first, weights);
+
+    for (int i = 0; i < n; i++) {
+        colors[i] = unique_color(input_colors, first[i]);
+    }
+
     ICBC_ASSERT(n <= count);
 
     return n;
-#endif
 }
 
 static int skip_blacks(const Vector3 * input_colors, const float * input_weights, int count, Vector3 * colors, float * weights)
@@ -1031,46 +1677,41 @@ static int skip_blacks(const Vector3 * input_colors, const float * input_weights
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 // PCA
 
-static Vector3 computeCentroid(int n, const Vector3 *__restrict points, const float *__restrict weights)
-{
-    Vector3 centroid = { 0 };
-    float total = 0.0f;
-
-    for (int i = 0; i < n; i++)
-    {
-        total += weights[i];
-        centroid += weights[i] * points[i];
-    }
-    centroid *= (1.0f / total);
-
-    return centroid;
-}
-
 static Vector3 computeCovariance(int n, const Vector3 *__restrict points, const float *__restrict weights, float *__restrict covariance)
 {
-    // compute the centroid
-    Vector3 centroid = computeCentroid(n, points, weights);
+    // Accumulate the moments in a single pass relative to the first point, which is close enough to the centroid to avoid
+    // cancellation, and then move them to the centroid.
+    const Vector3 origin = points[0];
 
-    // compute covariance matrix
-    for (int i = 0; i < 6; i++)
-    {
-        covariance[i] = 0.0f;
-    }
+    float total = 0.0f;
+    Vector3 sum = { 0 };
+    float m0 = 0.0f, m1 = 0.0f, m2 = 0.0f, m3 = 0.0f, m4 = 0.0f, m5 = 0.0f;
 
     for (int i = 0; i < n; i++)
     {
-        Vector3 a = (points[i] - centroid);    // @@ I think weight should be squared, but that seems to increase the error slightly.
+        Vector3 a = points[i] - origin;    // @@ I think weight should be squared, but that seems to increase the error slightly.
         Vector3 b = weights[i] * a;
 
-        covariance[0] += a.x * b.x;
-        covariance[1] += a.x * b.y;
-        covariance[2] += a.x * b.z;
-        covariance[3] += a.y * b.y;
-        covariance[4] += a.y * b.z;
-        covariance[5] += a.z * b.z;
+        total += weights[i];
+        sum += b;
+        m0 += a.x * b.x;
+        m1 += a.x * b.y;
+        m2 += a.x * b.z;
+        m3 += a.y * b.y;
+        m4 += a.y * b.z;
+        m5 += a.z * b.z;
     }
 
-    return centroid;
+    Vector3 offset = sum * (1.0f / total);
+
+    covariance[0] = m0 - sum.x * offset.x;
+    covariance[1] = m1 - sum.x * offset.y;
+    covariance[2] = m2 - sum.x * offset.z;
+    covariance[3] = m3 - sum.y * offset.y;
+    covariance[4] = m4 - sum.y * offset.z;
+    covariance[5] = m5 - sum.z * offset.z;
+
+    return origin + offset;
 }
 
 // @@ We should be able to do something cheaper...
@@ -1089,37 +1730,71 @@ static Vector3 estimatePrincipalComponent(const float * __restrict matrix)
     return row2;
 }
 
-static inline Vector3 firstEigenVector_PowerMethod(const float *__restrict matrix)
+// The largest eigenvalue of the covariance matrix is the largest root of its characteristic polynomial. With the substitution
+// l = q + p * x the polynomial becomes x^3 - 3x - 2r, whose largest root is in [1, 2]. Its closed form requires acos and cos, so
+// instead we start from an upper bound and refine it with Newton's method, which converges monotonically from above. The
+// eigenvector is the longest cross product of two rows of (A - l*I), which are orthogonal to it.
+static Vector3 firstEigenVector_Analytic(const float *__restrict matrix)
 {
-    if (matrix[0] == 0 && matrix[3] == 0 && matrix[5] == 0)
-    {
-        return {0};
+    const float a00 = matrix[0], a01 = matrix[1], a02 = matrix[2];
+    const float a11 = matrix[3], a12 = matrix[4], a22 = matrix[5];
+
+    float q = (a00 + a11 + a22) * (1.0f / 3.0f);
+    float d0 = a00 - q;
+    float d1 = a11 - q;
+    float d2 = a22 - q;
+    float p2 = d0 * d0 + d1 * d1 + d2 * d2 + 2 * (a01 * a01 + a02 * a02 + a12 * a12);
+
+    // The matrix is a multiple of the identity, any direction is as good as any other.
+    if (p2 == 0) {
+        return estimatePrincipalComponent(matrix);
     }
 
-    Vector3 v = estimatePrincipalComponent(matrix);
-
-    const int NUM = 8;
-    for (int i = 0; i < NUM; i++)
-    {
-        float x = v.x * matrix[0] + v.y * matrix[1] + v.z * matrix[2];
-        float y = v.x * matrix[1] + v.y * matrix[3] + v.z * matrix[4];
-        float z = v.x * matrix[2] + v.y * matrix[4] + v.z * matrix[5];
+    float p = sqrtf(p2 * (1.0f / 6.0f));
+    float det = d0 * (d1 * d2 - a12 * a12) - a01 * (a01 * d2 - a12 * a02) + a02 * (a01 * a12 - d1 * a02);
+    float r = clamp(det / (2 * p * p * p), -1.0f, 1.0f);
 
-        float norm = max(max(x, y), z);
+    float x = 1 + sqrtf((2.0f / 3.0f) * (1 + r));
+    for (int i = 0; i < 2; i++) {
+        x -= (x * x * x - 3 * x - 2 * r) / (3 * x * x - 3);
+    }
+    float l = q + p * x;
+
+    const Vector3 row0 = { a00 - l, a01, a02 };
+    const Vector3 row1 = { a01, a11 - l, a12 };
+    const Vector3 row2 = { a02, a12, a22 - l };
+
+    Vector3 c0 = cross(row0, row1);
+    Vector3 c1 = cross(row0, row2);
+    Vector3 c2 = cross(row1, row2);
+    float l0 = lengthSquared(c0);
+    float l1 = lengthSquared(c1);
+    float l2 = lengthSquared(c2);
+
+    Vector3 v = c2;
+    float lmax = l2;
+    if (l0 > lmax) { v = c0; lmax = l0; }
+    if (l1 > lmax) { v = c1; lmax = l1; }
+
+    // The two largest eigenvalues are equal, the eigenvector is anywhere in their plane.
+    if (lmax == 0) {
+        return estimatePrincipalComponent(matrix);
+    }
 
-        v = { x, y, z };
-        v *= (1.0f / norm);
+    // Use a consistent orientation, so that the colors are sorted from dark to bright.
+    if (v.x + v.y + v.z < 0) {
+        v *= -1.0f;
     }
 
     return v;
 }
 
-static Vector3 computePrincipalComponent_PowerMethod(int n, const Vector3 *__restrict points, const float *__restrict weights)
+static Vector3 computePrincipalComponent(int n, const Vector3 *__restrict points, const float *__restrict weights)
 {
     float matrix[6];
     computeCovariance(n, points, weights, matrix);
 
-    return firstEigenVector_PowerMethod(matrix);
+    return firstEigenVector_Analytic(matrix);
 }
 
 
@@ -1127,27 +1802,25 @@ static Vector3 computePrincipalComponent_PowerMethod(int n, const Vector3 *__res
 // SAT
 
 struct SummedAreaTable {
-    ICBC_ALIGN_16 float r[16];
-    ICBC_ALIGN_16 float g[16];
-    ICBC_ALIGN_16 float b[16];
-    ICBC_ALIGN_16 float w[16];
+    ICBC_ALIGN_64 float r[16];
+    ICBC_ALIGN_64 float g[16];
+    ICBC_ALIGN_64 float b[16];
+    ICBC_ALIGN_64 float w[16];
 };
 
-int compute_sat(const Vector3 * colors, const float * weights, int count, SummedAreaTable * sat)
+// Stable sort of up to 16 keys, equal keys are kept in input order. The rank of each key is the number of keys that go before
+// it, which we count comparing all pairs, so that there are no data dependent branches. Unused keys must be FLT_MAX.
+static void sort_keys(const float keys[16], int count, int order[16])
 {
-    // I've tried using a lower quality approximation of the principal direction, but the best fit line seems to produce best results.
-    Vector3 principal = computePrincipalComponent_PowerMethod(count, colors, weights);
-
-    // build the list of values
-    int order[16];
+#if ICBC_USE_SPMD == ICBC_FLOAT
+    // Without SIMD lanes counting all pairs is slower than the insertion sort.
     float dps[16];
     for (int i = 0; i < count; ++i)
     {
         order[i] = i;
-        dps[i] = dot(colors[i], principal);
+        dps[i] = keys[i];
     }
 
-    // stable sort
     for (int i = 0; i < count; ++i)
     {
         for (int j = i; j > 0 && dps[j] < dps[j - 1]; --j)
@@ -1156,61 +1829,136 @@ int compute_sat(const Vector3 * colors, const float * weights, int count, Summed
             swap(order[j], order[j - 1]);
         }
     }
+#else
+    ICBC_ALIGN_64 float ranks[16];
 
-    float w = weights[order[0]];
-    sat->r[0] = colors[order[0]].x * w;
-    sat->g[0] = colors[order[0]].y * w;
-    sat->b[0] = colors[order[0]].z * w;
-    sat->w[0] = w;
+    for (int i = 0; i < count; i += VEC_SIZE) {
+        const VFloat vkeys = vload(keys + i);
+        const VFloat vindex = lane_id() + vbroadcast(float(i));
 
-    for (int i = 1; i < count; i++) {
-        float w = weights[order[i]];
-        sat->r[i] = sat->r[i - 1] + colors[order[i]].x * w;
-        sat->g[i] = sat->g[i - 1] + colors[order[i]].y * w;
-        sat->b[i] = sat->b[i - 1] + colors[order[i]].z * w;
-        sat->w[i] = sat->w[i - 1] + w;
+        VFloat rank = vzero();
+        for (int j = 0; j < count; j++) {
+            const VFloat key = vbroadcast(keys[j]);
+            VMask before = (key < vkeys) | ((key == vkeys) & (vbroadcast(float(j)) < vindex));
+            rank = rank + vselect(before, vzero(), vbroadcast(1.0f));
+        }
+        vstore(ranks + i, rank);
     }
 
-    for (int i = count; i < 16; i++) {
-        sat->r[i] = FLT_MAX;
-        sat->g[i] = FLT_MAX;
-        sat->b[i] = FLT_MAX;
-        sat->w[i] = FLT_MAX;
+    for (int i = 0; i < count; i++) {
+        order[int(ranks[i])] = i;
     }
+#endif
+}
 
-    // Try incremental decimation:
-    // for each pair, compute distance and weighted half point. Determine error. If error under threshold, collapse and repeat.
+// Sort the colors along the principal axis and compute the summed area table. If there are more than max_count colors, the
+// closest consecutive ones are merged together, which reduces the number of cluster combinations to evaluate.
+int compute_sat(const Vector3 * colors, const float * weights, int count, int max_count, SummedAreaTable * sat)
+{
+    // I've tried using a lower quality approximation of the principal direction, but the best fit line seems to produce best results.
+    Vector3 principal = computePrincipalComponent(count, colors, weights);
 
-    /*if (m_count > 4)
+    // build the list of values
+    ICBC_ALIGN_64 float keys[16];
+    for (int i = 0; i < count; ++i)
     {
-        float threshold = 1.0f / 128;
+        keys[i] = dot(colors[i], principal);
+    }
+    for (int i = count; i < 16; ++i)
+    {
+        keys[i] = FLT_MAX;
+    }
 
-        uint j = 0;
-        for (uint i = 0; i < m_count; ++i)
-        {
-            // @@ Compare 3D distance instead of projected distance?
-            //if (j > 0 && dps[i] - dps[j - 1] < threshold) {
-            if (j > 0 && lengthSquared(colors[order[i]] - colors[order[j - 1]]) < threshold*threshold) {
-                m_colors[j - 1] += m_colors[i];
-                m_weights[j - 1] += m_weights[i];
-            }
-            else {
-                m_colors[j] = m_colors[i];
-                m_weights[j] = m_weights[i];
-                j += 1;
-            }
+    int order[16];
+    sort_keys(keys, count, order);
+
+    float dps[16];
+    ICBC_ALIGN_64 float ws[16];
+    ICBC_ALIGN_64 float rs[16];
+    ICBC_ALIGN_64 float gs[16];
+    ICBC_ALIGN_64 float bs[16];
+    for (int i = 0; i < count; i++) {
+        int j = order[i];
+        dps[i] = keys[j];
+        ws[i] = weights[j];
+        rs[i] = colors[j].x;
+        gs[i] = colors[j].y;
+        bs[i] = colors[j].z;
+    }
+
+#if ICBC_USE_SPMD == ICBC_FLOAT
+    sat->r[0] = rs[0] * ws[0];
+    sat->g[0] = gs[0] * ws[0];
+    sat->b[0] = bs[0] * ws[0];
+    sat->w[0] = ws[0];
+
+    for (int i = 1; i < count; i++) {
+        sat->r[i] = sat->r[i - 1] + rs[i] * ws[i];
+        sat->g[i] = sat->g[i - 1] + gs[i] * ws[i];
+        sat->b[i] = sat->b[i - 1] + bs[i] * ws[i];
+        sat->w[i] = sat->w[i - 1] + ws[i];
+    }
+#else
+    // Each lane adds the terms up to its own index in the same order as the sequential scan, so the sums are identical. The
+    // weighted colors are accumulated with vmad, which is fused where the scalar a + b * c is contracted to an FMA, and the
+    // excluded terms have zero weight, which leaves the sum unchanged.
+    for (int i = 0; i < count; i += VEC_SIZE) {
+        const VFloat vindex = lane_id() + vbroadcast(float(i));
+
+        VFloat r = vzero(), g = vzero(), b = vzero(), w = vzero();
+        for (int j = 0; j < count; j++) {
+            VMask include = vbroadcast(float(j)) <= vindex;
+            VFloat wj = vselect(include, vzero(), vbroadcast(ws[j]));
+            r = vmad(vbroadcast(rs[j]), wj, r);
+            g = vmad(vbroadcast(gs[j]), wj, g);
+            b = vmad(vbroadcast(bs[j]), wj, b);
+            w = w + wj;
         }
 
-        m_count = j;
+        vstore(sat->r + i, r);
+        vstore(sat->g + i, g);
+        vstore(sat->b + i, b);
+        vstore(sat->w + i, w);
+    }
+#endif
 
-        m_xsum = { 0.0f };
-        for (uint i = 0, j = 0; i < m_count; ++i)
-        {
-            m_xsum += m_colors[i];
+    if (count > max_count) {
+        while (count > max_count) {
+            // Find the pair of consecutive clusters whose merge increases the error the least.
+            int best = 0;
+            float best_cost = FLT_MAX;
+            for (int i = 0; i < count - 1; i++) {
+                float cost = ws[i] * ws[i + 1] / (ws[i] + ws[i + 1]) * square(dps[i + 1] - dps[i]);
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    best = i;
+                }
+            }
+
+            dps[best + 1] = (dps[best] * ws[best] + dps[best + 1] * ws[best + 1]) / (ws[best] + ws[best + 1]);
+            ws[best + 1] += ws[best];
+
+            // The next entry of the table already includes both clusters, so merging them just removes this one.
+            for (int i = best; i < count - 1; i++) {
+                dps[i] = dps[i + 1];
+                ws[i] = ws[i + 1];
+                sat->r[i] = sat->r[i + 1];
+                sat->g[i] = sat->g[i + 1];
+                sat->b[i] = sat->b[i + 1];
+                sat->w[i] = sat->w[i + 1];
+            }
+            count--;
         }
-    }*/
+    }
+
+    for (int i = count; i < 16; i++) {
+        sat->r[i] = FLT_MAX;
+        sat->g[i] = FLT_MAX;
+        sat->b[i] = FLT_MAX;
+        sat->w[i] = FLT_MAX;
+    }
 
-    return count;    
+    return count;
 }
 
 
@@ -1223,8 +1971,8 @@ struct Combinations {
 
 static ICBC_ALIGN_16 int s_fourClusterTotal[16];
 static ICBC_ALIGN_16 int s_threeClusterTotal[16];
-static ICBC_ALIGN_16 Combinations s_fourCluster[968 + 8];
-static ICBC_ALIGN_16 Combinations s_threeCluster[152 + 8];
+static ICBC_ALIGN_64 Combinations s_fourCluster[968 + 8];
+static ICBC_ALIGN_64 Combinations s_threeCluster[152 + 8];
 
 static void init_cluster_tables() {
 
@@ -1298,8 +2046,276 @@ static void init_cluster_tables() {
     }
 }
 
+#if ICBC_FAST_CLUSTER_FIT
+
+// Least squares terms of the cluster configurations when all the colors have unit weight, in the order of s_fourCluster and
+// s_threeCluster. alpha2 and alphabeta only depend on the configuration. beta2 and the factors also depend on the count, so
+// they are stored for each count, starting at s_fourFactorOffset[count-1] and s_threeFactorOffset[count-1]. The four color
+// terms are ninths, which are rounded once from their exact integer numerators.
+static ICBC_ALIGN_64 float s_fourAlpha2[968 + 8];
+static ICBC_ALIGN_64 float s_fourBeta2[4960];
+static ICBC_ALIGN_64 float s_fourAlphaBeta[968 + 8];
+static ICBC_ALIGN_64 float s_fourFactor[4960];
+static int s_fourFactorOffset[16];
+
+static ICBC_ALIGN_64 float s_threeAlpha2[152 + 8];
+static ICBC_ALIGN_64 float s_threeBeta2[152 + 8];
+static ICBC_ALIGN_64 float s_threeAlphaBeta[152 + 8];
+static ICBC_ALIGN_64 float s_threeFactor[1088];
+static int s_threeFactorOffset[16];
+
+static void init_lsqr_tables() {
+
+    for (int i = 0; i < 968 + 8; i++) {
+        int w0 = s_fourCluster[i].c0;
+        int w1 = s_fourCluster[i].c1 - s_fourCluster[i].c0;
+        int w2 = s_fourCluster[i].c2 - s_fourCluster[i].c1;
+
+        s_fourAlpha2[i] = float(9 * w0 + 4 * w1 + w2) / 9.0f;
+        s_fourAlphaBeta[i] = float(2 * (w1 + w2)) / 9.0f;
+    }
+
+    // Terms of the configurations read by the widest vectors, rounded up to 16.
+    for (int count = 1, offset = 0; count <= 16; count++) {
+        int total = (s_fourClusterTotal[count - 1] + 15) & ~15;
+        s_fourFactorOffset[count - 1] = offset;
+        for (int i = 0; i < total; i++) {
+            int w0 = s_fourCluster[i].c0;
+            int w1 = s_fourCluster[i].c1 - s_fourCluster[i].c0;
+            int w2 = s_fourCluster[i].c2 - s_fourCluster[i].c1;
+            int w3 = count - s_fourCluster[i].c2;
+
+            // 9 * alpha2, 9 * beta2 and 9 * alphabeta.
+            int a = 9 * w0 + 4 * w1 + w2;
+            int b = 9 * w3 + 4 * w2 + w1;
+            int ab = 2 * (w1 + w2);
+
+            s_fourBeta2[offset + i] = float(b) / 9.0f;
+            s_fourFactor[offset + i] = float(81.0 / double(a * b - ab * ab));
+        }
+        offset += total;
+        ICBC_ASSERT(offset <= 4960);
+    }
+
+    for (int i = 0; i < 152 + 8; i++) {
+        int c1 = s_threeCluster[i].c1;
+        int w0 = s_threeCluster[i].c0;
+        int w1 = s_threeCluster[i].c1 - s_threeCluster[i].c0;
+
+        s_threeAlpha2[i] = w0 + w1 * 0.25f;
+        s_threeBeta2[i] = w1 * 0.25f - c1;                          // + count
+        s_threeAlphaBeta[i] = w1 * 0.25f;
+    }
+
+    for (int count = 1, offset = 0; count <= 16; count++) {
+        int total = (s_threeClusterTotal[count - 1] + 15) & ~15;
+        s_threeFactorOffset[count - 1] = offset;
+        for (int i = 0; i < total; i++) {
+            float alpha2_sum = s_threeAlpha2[i];
+            float beta2_sum = s_threeBeta2[i] + count;
+            float alphabeta_sum = s_threeAlphaBeta[i];
+            s_threeFactor[offset + i] = 1.0f / (alpha2_sum * beta2_sum - alphabeta_sum * alphabeta_sum);
+        }
+        offset += total;
+        ICBC_ASSERT(offset <= 1088);
+    }
+}
+
+// Returns true when all the colors of the SAT have the same weight, so that the least squares factors can be looked up.
+static bool has_equal_weights(const SummedAreaTable & sat, int count) {
+    for (int i = 1; i < count; i++) {
+        if (sat.w[i] != sat.w[0] * float(i + 1)) return false;
+    }
+    return true;
+}
+
+#endif // ICBC_FAST_CLUSTER_FIT
+
+#if ICBC_CLUSTER_FIT_PRUNING
+
+// The error of a configuration is at least the error of fitting each of its clusters with its mean, -|S|^2/W relative to the
+// error of the SAT colors. Splitting a cluster lowers that bound, so the configurations of a group of VEC_SIZE entries of
+// s_fourCluster are bounded by the clusters of their common refinement: the ranges [0,t0), [t1,t2), [t3,t4), [t5,count)
+// and the single colors in [t0,t1), [t2,t3), [t4,t5).
+struct ClusterBounds {
+    uint8 t[6], pad[2];
+};
+
+static ClusterBounds s_fourClusterBounds[968 / VEC_SIZE];
+
+static void init_cluster_bounds() {
+    for (int i = 0; i < 968 / VEC_SIZE; i++) {
+        const Combinations * clusters = &s_fourCluster[i * VEC_SIZE];
+
+        int lo[3] = { 16, 16, 16 }, hi[3] = { 0, 0, 0 };
+        for (int l = 0; l < VEC_SIZE; l++) {
+            int c[3] = { clusters[l].c0, clusters[l].c1, clusters[l].c2 };
+            for (int k = 0; k < 3; k++) {
+                lo[k] = min(lo[k], c[k]);
+                hi[k] = max(hi[k], c[k]);
+            }
+        }
+
+        // Merge the overlapping ranges of single colors. Both bounds are sorted, because c0 <= c1 <= c2.
+        lo[1] = max(lo[1], hi[0]);
+        lo[2] = max(lo[2], hi[1]);
+
+        for (int k = 0; k < 3; k++) {
+            s_fourClusterBounds[i].t[2 * k + 0] = uint8(lo[k]);
+            s_fourClusterBounds[i].t[2 * k + 1] = uint8(hi[k]);
+        }
+    }
+}
+
+// Computes the error bound -|S|^2/W of the clusters of colors [s,e), and the prefix sums of the bounds of the single colors.
+static void compute_cluster_bounds(const SummedAreaTable & sat, int count, Vector3 metric_sqr, float bounds[17][32], float singles[17])
+{
+    ICBC_ALIGN_64 float r[32], g[32], b[32], w[32];
+    r[0] = g[0] = b[0] = w[0] = 0.0f;
+    for (int k = 1; k < 32; k++) {
+        int j = min(k, count) - 1;
+        r[k] = sat.r[j];
+        g[k] = sat.g[j];
+        b[k] = sat.b[j];
+        w[k] = sat.w[j];
+    }
+
+    for (int s = 0; s <= count; s++) {
+        const VFloat rs = vbroadcast(r[s]), gs = vbroadcast(g[s]), bs = vbroadcast(b[s]), ws = vbroadcast(w[s]);
+
+        for (int e = s & ~(VEC_SIZE - 1); e <= count; e += VEC_SIZE) {
+            VVector3 x = { vload(r + e) - rs, vload(g + e) - gs, vload(b + e) - bs };
+            VFloat weight = vload(w + e) - ws;
+
+            // Empty ranges and ranges with zero weight are bounded by 0.
+            VFloat bound = vzero() - vdot(x * x, vbroadcast(metric_sqr)) * vrcp(weight);
+            vstore(bounds[s] + e, vselect(weight > vzero(), vzero(), bound));
+        }
+    }
+
+    singles[0] = 0.0f;
+    for (int k = 0; k < count; k++) {
+        singles[k + 1] = singles[k] + bounds[k][k + 1];
+    }
+}
+
+// Index of the configuration that splits the colors at 1/6, 1/2 and 5/6 of their extent, or -1. The configurations with
+// c2 == t follow the ones of the previous totals, sorted by c0 and c1.
+static int seed_cluster_index(const SummedAreaTable & sat, int count, Vector3 metric_sqr)
+{
+    Vector3 colors[16];
+    colors[0] = Vector3{ sat.r[0], sat.g[0], sat.b[0] } / sat.w[0];
+    for (int i = 1; i < count; i++) {
+        colors[i] = Vector3{ sat.r[i] - sat.r[i - 1], sat.g[i] - sat.g[i - 1], sat.b[i] - sat.b[i - 1] } / (sat.w[i] - sat.w[i - 1]);
+    }
+
+    Vector3 axis = (colors[count - 1] - colors[0]) * metric_sqr;
+    float extent = dot(colors[count - 1] - colors[0], axis);
+    if (!(extent > 0)) return -1;
+
+    int c0 = 0, c1 = 0, c2 = 0;
+    for (int i = 0; i < count; i++) {
+        float t = dot(colors[i] - colors[0], axis);
+        c0 += (6 * t < extent);
+        c1 += (2 * t < extent);
+        c2 += (6 * t < 5 * extent);
+    }
+
+    int index = (c2 > 1 ? s_fourClusterTotal[c2 - 2] : 0) + c0 * (c2 + 1) - c0 * (c0 - 1) / 2 + (c1 - c0);
+    ICBC_ASSERT(s_fourCluster[index].c0 == c0 && s_fourCluster[index].c1 == c1 && s_fourCluster[index].c2 == c2);
+    return index;
+}
+
+ICBC_FORCEINLINE float cluster_bound(const ClusterBounds & c, int count, const float bounds[17][32], const float singles[17]) {
+    const uint8 * t = c.t;
+    return bounds[0][t[0]] + bounds[t[1]][t[2]] + bounds[t[3]][t[4]] + bounds[t[5]][count] +
+        (singles[t[1]] - singles[t[0]]) + (singles[t[3]] - singles[t[2]]) + (singles[t[5]] - singles[t[4]]);
+}
+
+#endif // ICBC_CLUSTER_FIT_PRUNING
+
+#if ICBC_USE_SSE41_SHUFFLE
+
+// The 16 entries of a SAT channel take 64 bytes, which are looked up with pshufb in 4 parts of 16 bytes.
+ICBC_FORCEINLINE void load_sat_parts(const float * sat, __m128i parts[4]) {
+    for (int j = 0; j < 4; j++) parts[j] = _mm_load_si128((const __m128i *)(sat + 4 * j));
+}
+
+// Byte indices of the SAT entries selected by the cluster boundaries in the given byte of each lane, for each one of the
+// first part_count parts. Out of range indices have the high bit set, so that pshufb returns 0, which is also the case for
+// boundary 0.
+ICBC_FORCEINLINE void sat_part_indices(__m128i packedClusterIndex, int byte, int part_count, __m128i indices[4]) {
+    const __m128i broadcast = _mm_add_epi8(_mm_setr_epi8(0, 0, 0, 0, 4, 4, 4, 4, 8, 8, 8, 8, 12, 12, 12, 12), _mm_set1_epi8(char(byte)));
+
+    // 4 * (c - 1) + {0, 1, 2, 3}, c is at most 16 so that the shift doesn't cross bytes.
+    __m128i c = _mm_shuffle_epi8(packedClusterIndex, broadcast);
+    __m128i index = _mm_add_epi8(_mm_slli_epi32(c, 2), _mm_set1_epi32(int(0xFFFEFDFC)));
+
+    for (int j = 0; j < part_count; j++) {
+        indices[j] = _mm_adds_epu8(_mm_xor_si128(index, _mm_set1_epi8(char(16 * j))), _mm_set1_epi8(0x70));
+    }
+}
+
+ICBC_FORCEINLINE VFloat lookup_sat(const __m128i parts[4], const __m128i indices[4], int part_count) {
+    __m128i v = _mm_shuffle_epi8(parts[0], indices[0]);
+    for (int j = 1; j < part_count; j++) {
+        v = _mm_or_si128(v, _mm_shuffle_epi8(parts[j], indices[j]));
+    }
+    return _mm_castsi128_ps(v);
+}
+
+// SAT entries with the 4 channels next to each other, shifted by one so that entry 0 is zero.
+ICBC_FORCEINLINE void load_sat_entries(const SummedAreaTable & sat, float entries[17][4]) {
+    _mm_store_ps(entries[0], _mm_setzero_ps());
+    for (int k = 0; k < 16; k += 4) {
+        __m128 r = _mm_load_ps(sat.r + k);
+        __m128 g = _mm_load_ps(sat.g + k);
+        __m128 b = _mm_load_ps(sat.b + k);
+        __m128 w = _mm_load_ps(sat.w + k);
+        _MM_TRANSPOSE4_PS(r, g, b, w);
+        _mm_store_ps(entries[k + 1], r);
+        _mm_store_ps(entries[k + 2], g);
+        _mm_store_ps(entries[k + 3], b);
+        _mm_store_ps(entries[k + 4], w);
+    }
+}
+
+ICBC_FORCEINLINE void load_sat_entries(const float entries[17][4], int c0, int c1, int c2, int c3, VVector3 * x, VFloat * w) {
+    __m128 e0 = _mm_load_ps(entries[c0]);
+    __m128 e1 = _mm_load_ps(entries[c1]);
+    __m128 e2 = _mm_load_ps(entries[c2]);
+    __m128 e3 = _mm_load_ps(entries[c3]);
+    _MM_TRANSPOSE4_PS(e0, e1, e2, e3);
+    x->x = e0;
+    x->y = e1;
+    x->z = e2;
+    *w = e3;
+}
+
+#endif // ICBC_USE_SSE41_SHUFFLE
+
+#if ICBC_USE_AVX2_GATHER
+
+// Gathers are fast on recent Intel CPUs, but slow on AMD Zen, init_dxt1 measures them against the permutes.
+static bool s_use_gather = false;
 
+// Gathers the SAT entries selected by the cluster boundaries at the given bit offset of each lane, zero for boundary 0.
+ICBC_FORCEINLINE void gather_sat(const SummedAreaTable & sat, __m256i packedClusterIndex, int shift, VVector3 * x, VFloat * w) {
+    __m256i c = _mm256_and_si256(_mm256_srli_epi32(packedClusterIndex, shift), _mm256_set1_epi32(0xFF));
+    __m256 mask = _mm256_castsi256_ps(_mm256_cmpgt_epi32(c, _mm256_setzero_si256()));
+    c = _mm256_sub_epi32(c, _mm256_set1_epi32(1));
 
+    x->x = _mm256_mask_i32gather_ps(_mm256_setzero_ps(), sat.r, c, mask, 4);
+    x->y = _mm256_mask_i32gather_ps(_mm256_setzero_ps(), sat.g, c, mask, 4);
+    x->z = _mm256_mask_i32gather_ps(_mm256_setzero_ps(), sat.b, c, mask, 4);
+    *w = _mm256_mask_i32gather_ps(_mm256_setzero_ps(), sat.w, c, mask, 4);
+}
+
+#endif // ICBC_USE_AVX2_GATHER
+
+// With equal_weights the least squares factors come from the tables instead of the SAT weights.
+// max_count is the upper bound of count, 4, 8 or 16, so that the SAT lookups of small palettes use fewer registers.
+template <bool equal_weights, int max_count>
 static void cluster_fit_three(const SummedAreaTable & sat, int count, Vector3 metric_sqr, Vector3 * start, Vector3 * end)
 {
     const float r_sum = sat.r[count-1];
@@ -1314,6 +2330,24 @@ static void cluster_fit_three(const SummedAreaTable & sat, int count, Vector3 me
     // check all possible clusters for this total order
     const int total_order_count = s_threeClusterTotal[count - 1];
 
+#if ICBC_FAST_CLUSTER_FIT
+    const float * factors = s_threeFactor + s_threeFactorOffset[count - 1];
+    const VFloat vcount = vbroadcast(float(count));
+    const VFloat vweight = vbroadcast(sat.w[0]);
+    const VFloat vfactor_scale = vbroadcast(1.0f / (sat.w[0] * sat.w[0]));
+#endif
+
+#if ICBC_USE_SSE41_SHUFFLE
+    __m128i rsat[4], gsat[4], bsat[4], wsat[4];
+    load_sat_parts(sat.r, rsat);
+    load_sat_parts(sat.g, gsat);
+    load_sat_parts(sat.b, bsat);
+    load_sat_parts(sat.w, wsat);
+
+    ICBC_ALIGN_16 float sat_entries[17][4];
+    load_sat_entries(sat, sat_entries);
+#endif
+
     for (int i = 0; i < total_order_count; i += VEC_SIZE)
     {
         VVector3 x0, x1;
@@ -1353,6 +2387,39 @@ static void cluster_fit_three(const SummedAreaTable & sat, int count, Vector3 me
         x1.z = _mm512_mask_blend_ps(c1mask, _mm512_setzero_ps(), _mm512_permutexvar_ps(c1, vbsat));
         w1 = _mm512_mask_blend_ps(c1mask, _mm512_setzero_ps(), _mm512_permutexvar_ps(c1, vwsat));
 
+#elif ICBC_USE_AVX512VL_PERMUTE
+
+        auto loadmask0 = lane_id() < vbroadcast(float(count));
+        auto loadmask1 = lane_id() < vbroadcast(float(count - 8));
+
+        // Load sat in two registers:
+        VFloat vrsat0 = vload(loadmask0, sat.r, FLT_MAX), vrsat1 = vload(loadmask1, sat.r + 8, FLT_MAX);
+        VFloat vgsat0 = vload(loadmask0, sat.g, FLT_MAX), vgsat1 = vload(loadmask1, sat.g + 8, FLT_MAX);
+        VFloat vbsat0 = vload(loadmask0, sat.b, FLT_MAX), vbsat1 = vload(loadmask1, sat.b + 8, FLT_MAX);
+        VFloat vwsat0 = vload(loadmask0, sat.w, FLT_MAX), vwsat1 = vload(loadmask1, sat.w + 8, FLT_MAX);
+
+        // Load 4 uint8 per lane.
+        __m256i packedClusterIndex = _mm256_load_si256((__m256i *)&s_threeCluster[i]);
+
+        auto c0 = _mm256_and_si256(packedClusterIndex, _mm256_set1_epi32(0xFF));
+        auto c0mask = _mm256_cmpgt_epi32_mask(c0, _mm256_setzero_si256());
+        c0 = _mm256_sub_epi32(c0, _mm256_set1_epi32(1));
+
+        // Select from the 16 entries of both registers, zero if the index was 0.
+        x0.x = _mm256_maskz_permutex2var_ps(c0mask, vrsat0, c0, vrsat1);
+        x0.y = _mm256_maskz_permutex2var_ps(c0mask, vgsat0, c0, vgsat1);
+        x0.z = _mm256_maskz_permutex2var_ps(c0mask, vbsat0, c0, vbsat1);
+        w0 = _mm256_maskz_permutex2var_ps(c0mask, vwsat0, c0, vwsat1);
+
+        auto c1 = _mm256_and_si256(_mm256_srli_epi32(packedClusterIndex, 8), _mm256_set1_epi32(0xFF));
+        auto c1mask = _mm256_cmpgt_epi32_mask(c1, _mm256_setzero_si256());
+        c1 = _mm256_sub_epi32(c1, _mm256_set1_epi32(1));
+
+        x1.x = _mm256_maskz_permutex2var_ps(c1mask, vrsat0, c1, vrsat1);
+        x1.y = _mm256_maskz_permutex2var_ps(c1mask, vgsat0, c1, vgsat1);
+        x1.z = _mm256_maskz_permutex2var_ps(c1mask, vbsat0, c1, vbsat1);
+        w1 = _mm256_maskz_permutex2var_ps(c1mask, vwsat0, c1, vwsat1);
+
 #elif ICBC_USE_AVX2_PERMUTE2
         // Fabian Giesen says not to mix _mm256_blendv_ps and _mm256_permutevar8x32_ps since they contend for the same resources and instead emulate blendv using bit ops.
         // On my machine (Intel Skylake) I'm not seeing any performance difference, but this may still be valuable for older CPUs.
@@ -1360,7 +2427,14 @@ static void cluster_fit_three(const SummedAreaTable & sat, int count, Vector3 me
         // Load 4 uint8 per lane.
         __m256i packedClusterIndex = _mm256_load_si256((__m256i *)&s_threeCluster[i]);
 
-        if (count <= 8) {
+#if ICBC_USE_AVX2_GATHER
+        if (s_use_gather) {
+            gather_sat(sat, packedClusterIndex, 0, &x0, &w0);
+            gather_sat(sat, packedClusterIndex, 8, &x1, &w1);
+        }
+        else
+#endif
+        if (max_count <= 8) {
 
             // Load sat.r in one register:
             VFloat r07 = vload(sat.r);
@@ -1443,7 +2517,7 @@ static void cluster_fit_three(const SummedAreaTable & sat, int count, Vector3 me
         // Load 4 uint8 per lane.
         __m256i packedClusterIndex = _mm256_load_si256((__m256i *)&s_threeCluster[i]);
 
-        if (count <= 8) {
+        if (max_count <= 8) {
 
             // Load index and decrement.
             auto c0 = _mm256_sub_epi32(_mm256_and_si256(packedClusterIndex, _mm256_set1_epi32(0xFF)), _mm256_set1_epi32(1));
@@ -1511,27 +2585,32 @@ static void cluster_fit_three(const SummedAreaTable & sat, int count, Vector3 me
             w1 = _mm256_blendv_ps(_mm256_permutevar8x32_ps(wHi, c1Hi), w1, _mm256_castsi256_ps(c1Hi));
         }
 
-#elif ICBC_USE_AVX2_GATHER // @@ Make this work with the 16-element SAT
-
-        // Load 4 uint8 per lane.
-        __m256i packedClusterIndex = _mm256_load_si256((__m256i *)&s_threeCluster[i]);
-
-        // Load SAT elements.
-        float * base = (float *)sat.x;
-
-        __m256i c0 = _mm256_slli_epi32(packedClusterIndex, 2);
-        c0 = _mm256_and_si256(c0, _mm256_set1_epi32(0x3FC));
-
-        x0.x = _mm256_i32gather_ps(base + 0, c0, 4);
-        x0.y = _mm256_i32gather_ps(base + 1, c0, 4);
-        x0.z = _mm256_i32gather_ps(base + 2, c0, 4);
-        w0 = _mm256_i32gather_ps(base + 3, c0, 4);
-
-        __m256i c1 = _mm256_and_si256(_mm256_srli_epi32(packedClusterIndex, 6), _mm256_set1_epi32(0x3FC));
-        x1.x = _mm256_i32gather_ps(base + 0, c1, 4);
-        x1.y = _mm256_i32gather_ps(base + 1, c1, 4);
-        x1.z = _mm256_i32gather_ps(base + 2, c1, 4);
-        w1 = _mm256_i32gather_ps(base + 3, c1, 4);
+#elif ICBC_USE_SSE41_SHUFFLE
+
+        if (max_count <= 4 || (max_count <= 8 && count < 8)) {
+            // Load 4 uint8 per lane.
+            __m128i packedClusterIndex = _mm_load_si128((__m128i *)&s_threeCluster[i]);
+
+            // Configurations past the total reference up to count + 1 entries, which must be in the table to read FLT_MAX.
+            __m128i indices[4];
+            sat_part_indices(packedClusterIndex, 0, 2, indices);
+            x0.x = lookup_sat(rsat, indices, 2);
+            x0.y = lookup_sat(gsat, indices, 2);
+            x0.z = lookup_sat(bsat, indices, 2);
+            w0 = lookup_sat(wsat, indices, 2);
+
+            sat_part_indices(packedClusterIndex, 1, 2, indices);
+            x1.x = lookup_sat(rsat, indices, 2);
+            x1.y = lookup_sat(gsat, indices, 2);
+            x1.z = lookup_sat(bsat, indices, 2);
+            w1 = lookup_sat(wsat, indices, 2);
+        }
+        else {
+            // With 4 parts it's faster to load the 4 channels of each lane and transpose them.
+            const Combinations * clusters = &s_threeCluster[i];
+            load_sat_entries(sat_entries, clusters[0].c0, clusters[1].c0, clusters[2].c0, clusters[3].c0, &x0, &w0);
+            load_sat_entries(sat_entries, clusters[0].c1, clusters[1].c1, clusters[2].c1, clusters[3].c1, &x1, &w1);
+        }
 
 #else
         // Plain scalar path
@@ -1559,14 +2638,27 @@ static void cluster_fit_three(const SummedAreaTable & sat, int count, Vector3 me
         }
 #endif
 
-        VFloat w2 = vbroadcast(w_sum) - w1;
         x1 = x1 - x0;
-        w1 = w1 - w0;
 
-        VFloat alphabeta_sum = w1 * vbroadcast(0.25f);
-        VFloat alpha2_sum = w0 + alphabeta_sum;
-        VFloat beta2_sum = w2 + alphabeta_sum;
-        VFloat factor = vrcp(alpha2_sum * beta2_sum - alphabeta_sum * alphabeta_sum);
+        VFloat alpha2_sum, beta2_sum, alphabeta_sum, factor;
+#if ICBC_FAST_CLUSTER_FIT
+        if (equal_weights) {
+            alpha2_sum = vload(s_threeAlpha2 + i) * vweight;
+            beta2_sum = (vload(s_threeBeta2 + i) + vcount) * vweight;
+            alphabeta_sum = vload(s_threeAlphaBeta + i) * vweight;
+            factor = vload(factors + i) * vfactor_scale;
+        }
+        else
+#endif
+        {
+            VFloat w2 = vbroadcast(w_sum) - w1;
+            w1 = w1 - w0;
+
+            alphabeta_sum = w1 * vbroadcast(0.25f);
+            alpha2_sum = w0 + alphabeta_sum;
+            beta2_sum = w2 + alphabeta_sum;
+            factor = vrcp(alpha2_sum * beta2_sum - alphabeta_sum * alphabeta_sum);
+        }
 
         VVector3 alphax_sum = x0 + x1 * vbroadcast(0.5f);
         VVector3 betax_sum = vbroadcast(r_sum, g_sum, b_sum) - alphax_sum;
@@ -1589,6 +2681,10 @@ static void cluster_fit_three(const SummedAreaTable & sat, int count, Vector3 me
 
         // keep the solution if it wins
         auto mask = (error < vbesterror);
+#if ICBC_FAST_CLUSTER_FIT
+        // The tables don't have FLT_MAX entries like the SAT, so the configurations past the total could win.
+        if (equal_weights) mask = mask & (lane_id() < vbroadcast(float(total_order_count - i)));
+#endif
 
         // I could mask the unused lanes here, but instead I set the invalid SAT entries to FLT_MAX.
         //mask = (mask & (vbroadcast(total_order_count) >= tid8(i))); // This doesn't seem to help. Is it OK to consider elements out of bounds?
@@ -1600,7 +2696,7 @@ static void cluster_fit_three(const SummedAreaTable & sat, int count, Vector3 me
 
     // Is there a better way to do this reduction?
     float besterror = FLT_MAX;    
-    int bestindex;
+    int bestindex = 0;
     for (int i = 0; i < VEC_SIZE; i++) {
         if (lane(vbesterror, i) < besterror) {
             besterror = lane(vbesterror, i);
@@ -1624,6 +2720,7 @@ static void cluster_fit_three(const SummedAreaTable & sat, int count, Vector3 me
 }
 
 
+template <bool equal_weights, int max_count>
 static void cluster_fit_four(const SummedAreaTable & sat, int count, Vector3 metric_sqr, Vector3 * start, Vector3 * end)
 {
     const float r_sum = sat.r[count-1];
@@ -1638,14 +2735,68 @@ static void cluster_fit_four(const SummedAreaTable & sat, int count, Vector3 met
     // check all possible clusters for this total order
     const int total_order_count = s_fourClusterTotal[count - 1];
 
-    for (int i = 0; i < total_order_count; i += VEC_SIZE)
-    {
-        VVector3 x0, x1, x2;
-        VFloat w0, w1, w2;
+#if ICBC_FAST_CLUSTER_FIT
+    const float * betas = s_fourBeta2 + s_fourFactorOffset[count - 1];
+    const float * factors = s_fourFactor + s_fourFactorOffset[count - 1];
+    const VFloat vweight = vbroadcast(sat.w[0]);
+    const VFloat vfactor_scale = vbroadcast(1.0f / (sat.w[0] * sat.w[0]));
+#endif
 
-        /*
-        // Another approach would be to load and broadcast one color at a time like I do in my old CUDA implementation.
-        uint akku = 0;
+#if ICBC_USE_SSE41_SHUFFLE
+    __m128i rsat[4], gsat[4], bsat[4], wsat[4];
+    load_sat_parts(sat.r, rsat);
+    load_sat_parts(sat.g, gsat);
+    load_sat_parts(sat.b, bsat);
+    load_sat_parts(sat.w, wsat);
+
+    ICBC_ALIGN_16 float sat_entries[17][4];
+    load_sat_entries(sat, sat_entries);
+#endif
+
+#if ICBC_CLUSTER_FIT_PRUNING
+    // Only the blocks with many colors have enough configurations to pay for the bounds.
+    const bool prune = (max_count == 16);
+    ICBC_ALIGN_64 float bounds[17][32];
+    float singles[17];
+    if (prune) compute_cluster_bounds(sat, count, metric_sqr, bounds, singles);
+
+    // The bounds and the errors are rounded differently, so only skip the configurations when the difference is well above
+    // the rounding errors. With that, the result is the same as with the exhaustive search.
+    const float slack = w_sum * (metric_sqr.x + metric_sqr.y + metric_sqr.z) * (1.0f / 65536.0f);
+    float threshold = FLT_MAX;
+
+    // Evaluate the group of a promising configuration first, so that the threshold prunes from the start.
+    int seed = prune ? seed_cluster_index(sat, count, metric_sqr) : -1;
+    if (seed >= 0) {
+        seed &= ~(VEC_SIZE - 1);
+        if (seed + VEC_SIZE >= total_order_count) seed = -1;
+    }
+
+    for (int k = (seed >= 0) ? -VEC_SIZE : 0; k < total_order_count; k += VEC_SIZE)
+    {
+        const int i = (k < 0) ? seed : k;
+#else
+    for (int i = 0; i < total_order_count; i += VEC_SIZE)
+    {
+#endif
+        VVector3 x0, x1, x2;
+        VFloat w0, w1, w2;
+
+#if ICBC_CLUSTER_FIT_PRUNING
+        // The last group may have configurations past the total, which are never skipped.
+        if (prune && k >= 0 && i + VEC_SIZE < total_order_count) {
+            float bound = cluster_bound(s_fourClusterBounds[i / VEC_SIZE], count, bounds, singles) - slack;
+            if (bound > threshold) continue;
+
+            // The threshold is only updated when it doesn't prune the configurations.
+            for (int l = 0; l < VEC_SIZE; l++) threshold = min(threshold, lane(vbesterror, l));
+            if (bound > threshold) continue;
+        }
+#endif
+
+        /*
+        // Another approach would be to load and broadcast one color at a time like I do in my old CUDA implementation.
+        uint akku = 0;
 
         // Compute alpha & beta for this permutation.
         #pragma unroll
@@ -1705,13 +2856,63 @@ static void cluster_fit_four(const SummedAreaTable & sat, int count, Vector3 met
         x2.z = _mm512_mask_blend_ps(c2mask, _mm512_setzero_ps(), _mm512_permutexvar_ps(c2, vbsat));
         w2 = _mm512_mask_blend_ps(c2mask, _mm512_setzero_ps(), _mm512_permutexvar_ps(c2, vwsat));
 
+#elif ICBC_USE_AVX512VL_PERMUTE
+
+        auto loadmask0 = lane_id() < vbroadcast(float(count));
+        auto loadmask1 = lane_id() < vbroadcast(float(count - 8));
+
+        // Load sat in two registers:
+        VFloat vrsat0 = vload(loadmask0, sat.r, FLT_MAX), vrsat1 = vload(loadmask1, sat.r + 8, FLT_MAX);
+        VFloat vgsat0 = vload(loadmask0, sat.g, FLT_MAX), vgsat1 = vload(loadmask1, sat.g + 8, FLT_MAX);
+        VFloat vbsat0 = vload(loadmask0, sat.b, FLT_MAX), vbsat1 = vload(loadmask1, sat.b + 8, FLT_MAX);
+        VFloat vwsat0 = vload(loadmask0, sat.w, FLT_MAX), vwsat1 = vload(loadmask1, sat.w + 8, FLT_MAX);
+
+        // Load 4 uint8 per lane.
+        __m256i packedClusterIndex = _mm256_load_si256((__m256i *)&s_fourCluster[i]);
+
+        auto c0 = _mm256_and_si256(packedClusterIndex, _mm256_set1_epi32(0xFF));
+        auto c0mask = _mm256_cmpgt_epi32_mask(c0, _mm256_setzero_si256());
+        c0 = _mm256_sub_epi32(c0, _mm256_set1_epi32(1));
+
+        // Select from the 16 entries of both registers, zero if the index was 0.
+        x0.x = _mm256_maskz_permutex2var_ps(c0mask, vrsat0, c0, vrsat1);
+        x0.y = _mm256_maskz_permutex2var_ps(c0mask, vgsat0, c0, vgsat1);
+        x0.z = _mm256_maskz_permutex2var_ps(c0mask, vbsat0, c0, vbsat1);
+        w0 = _mm256_maskz_permutex2var_ps(c0mask, vwsat0, c0, vwsat1);
+
+        auto c1 = _mm256_and_si256(_mm256_srli_epi32(packedClusterIndex, 8), _mm256_set1_epi32(0xFF));
+        auto c1mask = _mm256_cmpgt_epi32_mask(c1, _mm256_setzero_si256());
+        c1 = _mm256_sub_epi32(c1, _mm256_set1_epi32(1));
+
+        x1.x = _mm256_maskz_permutex2var_ps(c1mask, vrsat0, c1, vrsat1);
+        x1.y = _mm256_maskz_permutex2var_ps(c1mask, vgsat0, c1, vgsat1);
+        x1.z = _mm256_maskz_permutex2var_ps(c1mask, vbsat0, c1, vbsat1);
+        w1 = _mm256_maskz_permutex2var_ps(c1mask, vwsat0, c1, vwsat1);
+
+        auto c2 = _mm256_and_si256(_mm256_srli_epi32(packedClusterIndex, 16), _mm256_set1_epi32(0xFF));
+        auto c2mask = _mm256_cmpgt_epi32_mask(c2, _mm256_setzero_si256());
+        c2 = _mm256_sub_epi32(c2, _mm256_set1_epi32(1));
+
+        x2.x = _mm256_maskz_permutex2var_ps(c2mask, vrsat0, c2, vrsat1);
+        x2.y = _mm256_maskz_permutex2var_ps(c2mask, vgsat0, c2, vgsat1);
+        x2.z = _mm256_maskz_permutex2var_ps(c2mask, vbsat0, c2, vbsat1);
+        w2 = _mm256_maskz_permutex2var_ps(c2mask, vwsat0, c2, vwsat1);
+
 #elif ICBC_USE_AVX2_PERMUTE2
         // Fabian Giesen says not to mix _mm256_blendv_ps and _mm256_permutevar8x32_ps since they contend for the same resources and instead emulate blendv using bit ops.
 
         // Load 4 uint8 per lane.
         __m256i packedClusterIndex = _mm256_load_si256((__m256i *)&s_fourCluster[i]);
 
-        if (count <= 8) {
+#if ICBC_USE_AVX2_GATHER
+        if (s_use_gather) {
+            gather_sat(sat, packedClusterIndex, 0, &x0, &w0);
+            gather_sat(sat, packedClusterIndex, 8, &x1, &w1);
+            gather_sat(sat, packedClusterIndex, 16, &x2, &w2);
+        }
+        else
+#endif
+        if (max_count <= 8) {
             // Load sat.r in one register:
             VFloat r07 = vload(sat.r);
             VFloat g07 = vload(sat.g);
@@ -1813,7 +3014,7 @@ static void cluster_fit_four(const SummedAreaTable & sat, int count, Vector3 met
         // Load 4 uint8 per lane.
         __m256i packedClusterIndex = _mm256_load_si256((__m256i *)&s_fourCluster[i]);
 
-        if (count <= 8) {
+        if (max_count <= 8) {
             // Load index and decrement.
             auto c0 = _mm256_and_si256(packedClusterIndex, _mm256_set1_epi32(0xFF));
             c0 = _mm256_sub_epi32(c0, _mm256_set1_epi32(1));
@@ -1902,62 +3103,39 @@ static void cluster_fit_four(const SummedAreaTable & sat, int count, Vector3 met
             w2 = _mm256_blendv_ps(_mm256_permutevar8x32_ps(wHi, c2Hi), w2, _mm256_castsi256_ps(c2Hi));
         }
 
-#elif ICBC_USE_AVX2_GATHER
-
-        // Load 4 uint8 per lane.
-        __m256i packedClusterIndex = _mm256_load_si256((__m256i *)&s_fourCluster[i]);
-
-#if 0 // Masked gathers.
-        auto c0 = _mm256_and_si256(packedClusterIndex, _mm256_set1_epi32(0xFF));
-        auto c0mask = _mm256_castsi256_ps(_mm256_cmpgt_epi32(c0, _mm256_setzero_si256()));
-        c0 = _mm256_sub_epi32(c0, _mm256_set1_epi32(1));
-
-        x0.x = _mm256_mask_i32gather_ps(_mm256_setzero_ps(), sat.r, c0, c0mask, 4);
-        x0.y = _mm256_mask_i32gather_ps(_mm256_setzero_ps(), sat.g, c0, c0mask, 4);
-        x0.z = _mm256_mask_i32gather_ps(_mm256_setzero_ps(), sat.b, c0, c0mask, 4);
-        w0 = _mm256_mask_i32gather_ps(_mm256_setzero_ps(), sat.w, c0, c0mask, 4);
-
-        auto c1 = _mm256_and_si256(_mm256_srli_epi32(packedClusterIndex, 8), _mm256_set1_epi32(0xFF));
-        auto c1mask = _mm256_castsi256_ps(_mm256_cmpgt_epi32(c0, _mm256_setzero_si256()));
-        c1 = _mm256_sub_epi32(c1, _mm256_set1_epi32(1));
-
-        x1.x = _mm256_mask_i32gather_ps(_mm256_setzero_ps(), sat.r, c1, c1mask, 4);
-        x1.y = _mm256_mask_i32gather_ps(_mm256_setzero_ps(), sat.g, c1, c1mask, 4);
-        x1.z = _mm256_mask_i32gather_ps(_mm256_setzero_ps(), sat.b, c1, c1mask, 4);
-        w1 = _mm256_mask_i32gather_ps(_mm256_setzero_ps(), sat.w, c1, c1mask, 4);
-
-        auto c2 = _mm256_and_si256(_mm256_srli_epi32(packedClusterIndex, 16), _mm256_set1_epi32(0xFF));
-        auto c2mask = _mm256_castsi256_ps(_mm256_cmpgt_epi32(c0, _mm256_setzero_si256()));
-        c2 = _mm256_sub_epi32(c0, _mm256_set1_epi32(1));
-
-        x2.x = _mm256_mask_i32gather_ps(_mm256_setzero_ps(), sat.r, c2, c2mask, 4);
-        x2.y = _mm256_mask_i32gather_ps(_mm256_setzero_ps(), sat.g, c2, c2mask, 4);
-        x2.z = _mm256_mask_i32gather_ps(_mm256_setzero_ps(), sat.b, c2, c2mask, 4);
-        w2 = _mm256_mask_i32gather_ps(_mm256_setzero_ps(), sat.w, c2, c2mask, 4);
-#else
-        // Load SAT elements.
-        float * base = (float *)sat.x;
-
-        __m256i c0 = _mm256_slli_epi32(packedClusterIndex, 2);
-        c0 = _mm256_and_si256(c0, _mm256_set1_epi32(0x3FC));
-
-        x0.x = _mm256_i32gather_ps(base + 0, c0, 4);
-        x0.y = _mm256_i32gather_ps(base + 1, c0, 4);
-        x0.z = _mm256_i32gather_ps(base + 2, c0, 4);
-        w0 = _mm256_i32gather_ps(base + 3, c0, 4);
-
-        __m256i c1 = _mm256_and_si256(_mm256_srli_epi32(packedClusterIndex, 6), _mm256_set1_epi32(0x3FC));
-        x1.x = _mm256_i32gather_ps(base + 0, c1, 4);
-        x1.y = _mm256_i32gather_ps(base + 1, c1, 4);
-        x1.z = _mm256_i32gather_ps(base + 2, c1, 4);
-        w1 = _mm256_i32gather_ps(base + 3, c1, 4);
-
-        __m256i c2 = _mm256_and_si256(_mm256_srli_epi32(packedClusterIndex, 14), _mm256_set1_epi32(0x3FC));
-        x2.x = _mm256_i32gather_ps(base + 0, c2, 4);
-        x2.y = _mm256_i32gather_ps(base + 1, c2, 4);
-        x2.z = _mm256_i32gather_ps(base + 2, c2, 4);
-        w2 = _mm256_i32gather_ps(base + 3, c2, 4);
-#endif
+#elif ICBC_USE_SSE41_SHUFFLE
+
+        if (max_count <= 4 || (max_count <= 8 && count < 8)) {
+            // Load 4 uint8 per lane.
+            __m128i packedClusterIndex = _mm_load_si128((__m128i *)&s_fourCluster[i]);
+
+            // Configurations past the total reference up to count + 1 entries, which must be in the table to read FLT_MAX.
+            __m128i indices[4];
+            sat_part_indices(packedClusterIndex, 0, 2, indices);
+            x0.x = lookup_sat(rsat, indices, 2);
+            x0.y = lookup_sat(gsat, indices, 2);
+            x0.z = lookup_sat(bsat, indices, 2);
+            w0 = lookup_sat(wsat, indices, 2);
+
+            sat_part_indices(packedClusterIndex, 1, 2, indices);
+            x1.x = lookup_sat(rsat, indices, 2);
+            x1.y = lookup_sat(gsat, indices, 2);
+            x1.z = lookup_sat(bsat, indices, 2);
+            w1 = lookup_sat(wsat, indices, 2);
+
+            sat_part_indices(packedClusterIndex, 2, 2, indices);
+            x2.x = lookup_sat(rsat, indices, 2);
+            x2.y = lookup_sat(gsat, indices, 2);
+            x2.z = lookup_sat(bsat, indices, 2);
+            w2 = lookup_sat(wsat, indices, 2);
+        }
+        else {
+            // With 4 parts it's faster to load the 4 channels of each lane and transpose them.
+            const Combinations * clusters = &s_fourCluster[i];
+            load_sat_entries(sat_entries, clusters[0].c0, clusters[1].c0, clusters[2].c0, clusters[3].c0, &x0, &w0);
+            load_sat_entries(sat_entries, clusters[0].c1, clusters[1].c1, clusters[2].c1, clusters[3].c1, &x1, &w1);
+            load_sat_entries(sat_entries, clusters[0].c2, clusters[1].c2, clusters[2].c2, clusters[3].c2, &x2, &w2);
+        }
 
 #else
         // Scalar path
@@ -1995,17 +3173,30 @@ static void cluster_fit_four(const SummedAreaTable & sat, int count, Vector3 met
         }
 #endif
 
-        VFloat w3 = vbroadcast(w_sum) - w2;
         x2 = x2 - x1;
         x1 = x1 - x0;
-        w2 = w2 - w1;
-        w1 = w1 - w0;
 
-        VFloat alpha2_sum = vmad(w2, vbroadcast(1.0f / 9.0f), vmad(w1, vbroadcast(4.0f / 9.0f), w0));
-        VFloat beta2_sum  = vmad(w1, vbroadcast(1.0f / 9.0f), vmad(w2, vbroadcast(4.0f / 9.0f), w3));
+        VFloat alpha2_sum, beta2_sum, alphabeta_sum, factor;
+#if ICBC_FAST_CLUSTER_FIT
+        if (equal_weights) {
+            alpha2_sum = vload(s_fourAlpha2 + i) * vweight;
+            beta2_sum = vload(betas + i) * vweight;
+            alphabeta_sum = vload(s_fourAlphaBeta + i) * vweight;
+            factor = vload(factors + i) * vfactor_scale;
+        }
+        else
+#endif
+        {
+            VFloat w3 = vbroadcast(w_sum) - w2;
+            w2 = w2 - w1;
+            w1 = w1 - w0;
+
+            alpha2_sum = vmad(w2, vbroadcast(1.0f / 9.0f), vmad(w1, vbroadcast(4.0f / 9.0f), w0));
+            beta2_sum  = vmad(w1, vbroadcast(1.0f / 9.0f), vmad(w2, vbroadcast(4.0f / 9.0f), w3));
 
-        VFloat alphabeta_sum = (w1 + w2) * vbroadcast(2.0f / 9.0f);
-        VFloat factor = vrcp(alpha2_sum * beta2_sum - alphabeta_sum * alphabeta_sum);
+            alphabeta_sum = (w1 + w2) * vbroadcast(2.0f / 9.0f);
+            factor = vrcp(alpha2_sum * beta2_sum - alphabeta_sum * alphabeta_sum);
+        }
 
         VVector3 alphax_sum = vmad(x2, vbroadcast(1.0f / 3.0f), vmad(x1, vbroadcast(2.0f / 3.0f), x0));
         VVector3 betax_sum = vbroadcast(r_sum, g_sum, b_sum) - alphax_sum;
@@ -2025,8 +3216,22 @@ static void cluster_fit_four(const SummedAreaTable & sat, int count, Vector3 met
         // apply the metric to the error term
         VFloat error = vdot(e1, vbroadcast(metric_sqr));
 
+#if ICBC_CLUSTER_FIT_PRUNING
+        // The seed only sets the threshold, its configurations are evaluated again in order.
+        if (k < 0) {
+            for (int l = 0; l < VEC_SIZE; l++) {
+                if (lane(error, l) < threshold) threshold = lane(error, l);
+            }
+            continue;
+        }
+#endif
+
         // keep the solution if it wins
         auto mask = (error < vbesterror);
+#if ICBC_FAST_CLUSTER_FIT
+        // The tables don't have FLT_MAX entries like the SAT, so the configurations past the total could win.
+        if (equal_weights) mask = mask & (lane_id() < vbroadcast(float(total_order_count - i)));
+#endif
         
         // We could mask the unused lanes here, but instead set the invalid SAT entries to FLT_MAX.
         //mask = (mask & (vbroadcast(total_order_count) >= tid8(i))); // This doesn't seem to help. Is it OK to consider elements out of bounds?
@@ -2038,7 +3243,7 @@ static void cluster_fit_four(const SummedAreaTable & sat, int count, Vector3 met
 
     // Is there a better way to do this reduction?
     float besterror = FLT_MAX;    
-    int bestindex;
+    int bestindex = 0;
     for (int i = 0; i < VEC_SIZE; i++) {
         if (lane(vbesterror, i) < besterror) {
             besterror = lane(vbesterror, i);
@@ -2059,349 +3264,280 @@ static void cluster_fit_four(const SummedAreaTable & sat, int count, Vector3 met
     *end = bestend;
 }
 
+typedef void ClusterFitFunction(const SummedAreaTable & sat, int count, Vector3 metric_sqr, Vector3 * start, Vector3 * end);
 
-#if 0 || ICBC_FAST_CLUSTER_FIT
-
-struct Precomp {
-    //uint8 c0, c1, c2, c3;
-    float alpha2_sum;
-    float beta2_sum;
-    float alphabeta_sum;
-    float factor;
+// Kernels indexed by [equal_weights][count_class(count)].
+static ClusterFitFunction * const s_clusterFitThree[2][3] = {
+    { cluster_fit_three<false, 4>, cluster_fit_three<false, 8>, cluster_fit_three<false, 16> },
+    { cluster_fit_three<true, 4>, cluster_fit_three<true, 8>, cluster_fit_three<true, 16> },
 };
 
-static ICBC_ALIGN_16 Precomp s_fourElement[969];
-static ICBC_ALIGN_16 Precomp s_threeElement[153];
-
-static void init_lsqr_tables() {
-
-    // Precompute least square factors for all possible 4-cluster configurations.
-    for (int c0 = 0, i = 0; c0 <= 16; c0++) {
-        for (int c1 = 0; c1 <= 16 - c0; c1++) {
-            for (int c2 = 0; c2 <= 16 - c0 - c1; c2++, i++) {
-                int c3 = 16 - c0 - c1 - c2;
-
-                //s_fourElement[i].c0 = c0;
-                //s_fourElement[i].c1 = c0 + c1;
-                //s_fourElement[i].c2 = c0 + c1 + c2;
-                //s_fourElement[i].c3 = 16;
-
-                //int alpha2_sum = c0 * 9 + c1 * 4 + c2;
-                //int beta2_sum = c3 * 9 + c2 * 4 + c1;
-                //int alphabeta_sum = (c1 + c2) * 2;
-                //float factor = float(9.0 / (alpha2_sum * beta2_sum - alphabeta_sum * alphabeta_sum));
-
-                float alpha2_sum = c0 + c1 * (4.0f / 9.0f) + c2 * (1.0f / 9.0f);
-                float beta2_sum = c3 + c2 * (4.0f / 9.0f) + c1 * (1.0f / 9.0f);
-                float alphabeta_sum = (c1 + c2) * (2.0f / 9.0f);
-                float factor = float(1.0 / (alpha2_sum * beta2_sum - alphabeta_sum * alphabeta_sum));
-
-                s_fourElement[i].alpha2_sum = (float)alpha2_sum;
-                s_fourElement[i].beta2_sum = (float)beta2_sum;
-                s_fourElement[i].alphabeta_sum = (float)alphabeta_sum;
-                s_fourElement[i].factor = factor;
-            }
-        }
-    }
-
-    // Precompute least square factors for all possible 3-cluster configurations.
-    for (int c0 = 0, i = 0; c0 <= 16; c0++) {
-        for (int c1 = 0; c1 <= 16 - c0; c1++, i++) {
-            int c2 = 16 - c1 - c0;
-
-            //s_threeElement[i].c0 = c0;
-            //s_threeElement[i].c1 = c1;
-            //s_threeElement[i].c2 = c2;
-
-            //int alpha2_sum = 4 * c0 + c1;
-            //int beta2_sum = 4 * c2 + c1;
-            //int alphabeta_sum = c1;
-            //float factor = float(4.0 / (alpha2_sum * beta2_sum - alphabeta_sum * alphabeta_sum));
-
-            float alpha2_sum = c0 + c1 * 0.25f;
-            float beta2_sum = c2 + c1 * 0.25f;
-            float alphabeta_sum = c1 * 0.25f;
-            float factor = float(1.0 / (alpha2_sum * beta2_sum - alphabeta_sum * alphabeta_sum));
-
-            s_threeElement[i].alpha2_sum = (float)alpha2_sum;
-            s_threeElement[i].beta2_sum = (float)beta2_sum;
-            s_threeElement[i].alphabeta_sum = (float)alphabeta_sum;
-            s_threeElement[i].factor = factor;
-        }
-    }
-}
-
-// This is the ideal way to round, but it's too expensive to do this in the inner loop.
-inline Vector3 round565(const Vector3 & v) {
-    static const Vector3 grid = { 31.0f, 63.0f, 31.0f };
-    static const Vector3 gridrcp = { 1.0f / 31.0f, 1.0f / 63.0f, 1.0f / 31.0f };
+static ClusterFitFunction * const s_clusterFitFour[2][3] = {
+    { cluster_fit_four<false, 4>, cluster_fit_four<false, 8>, cluster_fit_four<false, 16> },
+    { cluster_fit_four<true, 4>, cluster_fit_four<true, 8>, cluster_fit_four<true, 16> },
+};
 
-    Vector3 q = floor(grid * v);
-    q.x += (v.x > midpoints5[int(q.x)]);
-    q.y += (v.y > midpoints6[int(q.y)]);
-    q.z += (v.z > midpoints5[int(q.z)]);
-    q *= gridrcp;
-    return q;
+inline int count_class(int count) {
+    return (count > 4) + (count > 8);
 }
 
-void ClusterFit::setColorSet(const Vector4 * colors, const Vector3 & metric)
+static void cluster_fit_three(const SummedAreaTable & sat, int count, Vector3 metric_sqr, Vector3 * start, Vector3 * end)
 {
-    m_metricSqr = metric * metric;
-
-    m_count = 16;
-
-    static const float weights[16] = {1,1,1,1, 1,1,1,1, 1,1,1,1, 1,1,1,1};
-    Vector3 vc[16];
-    for (int i = 0; i < 16; i++) vc[i] = colors[i].xyz;
-
-    // I've tried using a lower quality approximation of the principal direction, but the best fit line seems to produce best results.
-    Vector3 principal = computePrincipalComponent_PowerMethod(16, vc, weights);
-
-    // build the list of values
-    int order[16];
-    float dps[16];
-    for (uint i = 0; i < 16; ++i)
-    {
-        order[i] = i;
-        dps[i] = dot(colors[i].xyz, principal);
-
-        if (colors[i].x < midpoints5[0] && colors[i].y < midpoints6[0] && colors[i].z < midpoints5[0]) anyBlack = true;
-    }
-
-    // stable sort
-    for (uint i = 0; i < 16; ++i)
-    {
-        for (uint j = i; j > 0 && dps[j] < dps[j - 1]; --j)
-        {
-            swap(dps[j], dps[j - 1]);
-            swap(order[j], order[j - 1]);
-        }
-    }
-
-    for (uint i = 0; i < 16; ++i)
-    {
-        int p = order[i];
-        m_colors[i] = colors[p].xyz;
-        m_weights[i] = 1.0f;
-    }
+#if ICBC_FAST_CLUSTER_FIT
+    bool equal_weights = has_equal_weights(sat, count);
+#else
+    bool equal_weights = false;
+#endif
+    s_clusterFitThree[equal_weights][count_class(count)](sat, count, metric_sqr, start, end);
 }
 
-void ClusterFit::fastCompress3(Vector3 * start, Vector3 * end)
+static void cluster_fit_four(const SummedAreaTable & sat, int count, Vector3 metric_sqr, Vector3 * start, Vector3 * end)
 {
-    ICBC_ASSERT(m_count == 16);
-    const Vector3 grid = { 31.0f, 63.0f, 31.0f };
-    const Vector3 gridrcp = { 1.0f / 31.0f, 1.0f / 63.0f, 1.0f / 31.0f };
-
-    // declare variables
-    Vector3 beststart = { 0.0f };
-    Vector3 bestend = { 0.0f };
-    float besterror = FLT_MAX;
-
-    Vector3 x0 = { 0.0f };
-
-    // check all possible clusters for this total order
-    for (uint c0 = 0, i = 0; c0 <= 16; c0++)
-    {
-        Vector3 x1 = { 0.0f };
-
-        for (uint c1 = 0; c1 <= 16 - c0; c1++, i++)
-        {
-            float const alpha2_sum = s_threeElement[i].alpha2_sum;
-            float const beta2_sum = s_threeElement[i].beta2_sum;
-            float const alphabeta_sum = s_threeElement[i].alphabeta_sum;
-            float const factor = s_threeElement[i].factor;
-
-            Vector3 const alphax_sum = x0 + x1 * 0.5f;
-            Vector3 const betax_sum = Vector3(r_sum, g_sum, b_sum) - alphax_sum;
-
-            Vector3 a = (alphax_sum * beta2_sum - betax_sum * alphabeta_sum) * factor;
-            Vector3 b = (betax_sum * alpha2_sum - alphax_sum * alphabeta_sum) * factor;
-
-            // clamp to the grid
-            a = saturate(a);
-            b = saturate(b);
-#if ICBC_PERFECT_ROUND
-            a = round565(a);
-            b = round565(b);
+#if ICBC_FAST_CLUSTER_FIT
+    bool equal_weights = has_equal_weights(sat, count);
 #else
-            a = round(grid * a) * gridrcp;
-            b = round(grid * b) * gridrcp;
+    bool equal_weights = false;
 #endif
+    s_clusterFitFour[equal_weights][count_class(count)](sat, count, metric_sqr, start, end);
+}
 
-            // compute the error
-            Vector3 e1 = a * a*alpha2_sum + b * b*beta2_sum + 2.0f*(a*b*alphabeta_sum - a * alphax_sum - b * betax_sum);
-
-            // apply the metric to the error term
-            float error = dot(e1, m_metricSqr);
-
-            // keep the solution if it wins
-            if (error < besterror)
-            {
-                besterror = error;
-                beststart = a;
-                bestend = b;
-            }
+#if ICBC_USE_AVX2_GATHER
 
-            x1 += m_colors[c0 + c1];
-        }
+static volatile float s_sat_lookup_sink;
 
-        x0 += m_colors[c0];
+// Time the cluster fit of a block of 16 colors with both SAT lookups and keep the fastest one.
+static void select_sat_lookup() {
+    Vector3 colors[16];
+    float weights[16];
+    for (int i = 0; i < 16; i++) {
+        colors[i] = { float(i) / 15, float(i * 7 % 16) / 15, float(15 - i) / 15 };
+        weights[i] = float(1 + (i & 1));    // Unequal weights, so that the weights are looked up too.
     }
 
-    *start = beststart;
-    *end = bestend;
-}
-
-void ClusterFit::fastCompress4(Vector3 * start, Vector3 * end)
-{
-    ICBC_ASSERT(m_count == 16);
-    const Vector3 grid = { 31.0f, 63.0f, 31.0f };
-    const Vector3 gridrcp = { 1.0f / 31.0f, 1.0f / 63.0f, 1.0f / 31.0f };
+    SummedAreaTable sat;
+    int count = compute_sat(colors, weights, 16, 16, &sat);
+    Vector3 metric_sqr = { 1, 1, 1 };
 
-    // declare variables
-    Vector3 beststart = { 0.0f };
-    Vector3 bestend = { 0.0f };
-    float besterror = FLT_MAX;
+    uint64 best_time[2] = { ~uint64(0), ~uint64(0) };
+    for (int i = 0; i < 16; i++) {
+        s_use_gather = (i & 1) != 0;
 
-#if !ICBC_USE_SAT
-    Vector3 x0 = { 0.0f };
+        Vector3 start, end;
+        uint64 time = __rdtsc();
+        cluster_fit_four<false, 16>(sat, count, metric_sqr, &start, &end);
+        s_sat_lookup_sink = start.x + end.x;
+        time = __rdtsc() - time;
 
-    // check all possible clusters for this total order
-    for (uint c0 = 0, i = 0; c0 <= 16; c0++)
-    {
-        Vector3 x1 = { 0.0f };
+        best_time[i & 1] = min(best_time[i & 1], time);
+    }
 
-        for (uint c1 = 0; c1 <= 16 - c0; c1++)
-        {
-            Vector3 x2 = { 0.0f };
-
-            for (uint c2 = 0; c2 <= 16 - c0 - c1; c2++, i++)
-            {
-                float const alpha2_sum = s_fourElement[i].alpha2_sum;
-                float const beta2_sum = s_fourElement[i].beta2_sum;
-                float const alphabeta_sum = s_fourElement[i].alphabeta_sum;
-                float const factor = s_fourElement[i].factor;
-
-                Vector3 const alphax_sum = x0 + x1 * (2.0f / 3.0f) + x2 * (1.0f / 3.0f);
-                Vector3 const betax_sum = m_xsum - alphax_sum;
-
-                Vector3 a = (alphax_sum * beta2_sum - betax_sum * alphabeta_sum) * factor;
-                Vector3 b = (betax_sum * alpha2_sum - alphax_sum * alphabeta_sum) * factor;
-
-                // clamp to the grid
-                a = saturate(a);
-                b = saturate(b);
-#if ICBC_PERFECT_ROUND
-                a = round565(a);
-                b = round565(b);
-#else
-                a = round(grid * a) * gridrcp;
-                b = round(grid * b) * gridrcp;
-#endif
-                // @@ It would be much more accurate to evaluate the error exactly. If we computed the error exactly, then
-                //    we could bake the *factor in alpha2_sum, beta2_sum and alphabeta_sum.
+    s_use_gather = best_time[1] < best_time[0];
+}
 
-                // compute the error
-                Vector3 e1 = a * a*alpha2_sum + b * b*beta2_sum + 2.0f*(a*b*alphabeta_sum - a * alphax_sum - b * betax_sum);
+#endif // ICBC_USE_AVX2_GATHER
 
-                // apply the metric to the error term
-                float error = dot(e1, m_metricSqr);
+#if ICBC_USE_SPMD == ICBC_AVX2 || ICBC_USE_SPMD == ICBC_AVX512VL
 
-                // keep the solution if it wins
-                if (error < besterror)
-                {
-                    besterror = error;
-                    beststart = a;
-                    bestend = b;
-                }
+// Indices of the SAT entries selected by the 16 bit cluster boundaries, for the low and the high byte of each sum. Boundary 0
+// sets the high bit of both indices, so that pshufb returns 0.
+ICBC_FORCEINLINE void sat_indices16(__m256i c, __m256i * lo_index, __m256i * hi_index) {
+    __m256i k = _mm256_sub_epi16(c, _mm256_set1_epi16(1));
+    *lo_index = _mm256_or_si256(k, _mm256_set1_epi16(short(0x8000)));
+    *hi_index = _mm256_or_si256(_mm256_slli_epi16(k, 8), _mm256_set1_epi16(0x80));
+}
 
-                x2 += m_colors[c0 + c1 + c2];
-            }
+ICBC_FORCEINLINE __m256i lookup_sat16(__m256i lo_table, __m256i hi_table, __m256i lo_index, __m256i hi_index) {
+    return _mm256_or_si256(_mm256_shuffle_epi8(lo_table, lo_index), _mm256_shuffle_epi8(hi_table, hi_index));
+}
 
-            x1 += m_colors[c0 + c1];
+// Fixed point version of cluster_fit_four. When the colors have 8 bits and the weights are integers, as is the case with unit
+// input weights even after merging similar colors, the sums of the SAT are exact 16 bit integers. They are looked up with
+// pshufb and the least squares terms are evaluated in 16 bit lanes with madd, which tests 16 cluster configurations per
+// iteration. The end points are solved in float, but the error is computed exactly from the quantized end points.
+// Returns false when the SAT doesn't meet these requirements.
+// The selected configurations differ from the float kernel in some blocks, and the image error can be higher or lower, by around
+// one part per million either way.
+static bool cluster_fit_four_fixed(const SummedAreaTable & sat, int count, Vector3 metric_sqr, Vector3 * start, Vector3 * end)
+{
+    // Convert the SAT to integers, the entries past the end repeat the totals. Color sums take 12 bits and are split in two bytes.
+    ICBC_ALIGN_16 uint8 table[7][16];
+    int sums[4];
+    for (int i = 0; i < 16; i++) {
+        const int k = min(i, count - 1);
+        const float x[4] = { sat.r[k] * 255.0f, sat.g[k] * 255.0f, sat.b[k] * 255.0f, sat.w[k] };
+        for (int c = 0; c < 4; c++) {
+            sums[c] = int(x[c] + 0.5f);
+            if (!(fabsf(x[c] - float(sums[c])) < 0.01f)) return false;
         }
-
-        x0 += m_colors[c0];
+        if (sums[3] > 16) return false;
+        for (int c = 0; c < 3; c++) {
+            if (sums[c] < 0 || sums[c] > 255 * sums[3]) return false;
+            table[2 * c + 0][i] = uint8(sums[c] & 0xFF);
+            table[2 * c + 1][i] = uint8(sums[c] >> 8);
+        }
+        table[6][i] = uint8(sums[3]);
     }
-#else
-    // This could be done in set colors.
-    Vector3 x_sat[17];
-    //float w_sat[17];
 
-    Vector3 x_sum = { 0 };
-    //float w_sum = 0;
-    for (uint i = 0; i < 17; i++) {
-        x_sat[i] = x_sum;
-        //w_sat[i] = w_sum;
-        x_sum += m_colors[i];
-        //w_sum += m_weights[i];
+    __m256i lo_table[3], hi_table[3], sum3[3];
+    for (int c = 0; c < 3; c++) {
+        lo_table[c] = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)table[2 * c + 0]));
+        hi_table[c] = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)table[2 * c + 1]));
+        sum3[c] = _mm256_set1_epi16(short(3 * sums[c]));
+    }
+    const __m256i w_table = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)table[6]));
+    const __m256i w_sum = _mm256_set1_epi16(short(sums[3]));
+
+    // The end points are num / (85 * den) in the [0-1] range, and quantized to q = a * s with s = 31 or 63. The error of each
+    // channel is T1 / (9 * s^2) - 2 * T2 / (765 * s), where T1 and T2 are the integer terms computed below.
+    const float q_scale[3] = { 31.0f, 63.0f, 31.0f };
+    const float metric[3] = { metric_sqr.x, metric_sqr.y, metric_sqr.z };
+    __m256i q_max[3];
+    __m256 k1[3], k2[3];
+    for (int c = 0; c < 3; c++) {
+        q_max[c] = _mm256_set1_epi16(short(q_scale[c]));
+        k1[c] = _mm256_set1_ps(metric[c] / (9.0f * q_scale[c] * q_scale[c]));
+        k2[c] = _mm256_set1_ps(metric[c] * 2.0f / (765.0f * q_scale[c]));
     }
 
-    // Ideas:
-    // - Use this method with weighted colors. Use only precomputed counts and summed area tables. Compute alpha/beta factors on the fly.
-    // - We can precompute tables for reduced number of colors. Are these tables subset of each other? Can we simply change the sum? Yes!
-    // - Only do SIMD version of this loop. Lay down table and sat optimally for AVX access patterns.
-
-    // check all possible clusters for this total order
-    for (uint i = 0; i < 969; i+=1)
-    {
-        int c0 = s_fourElement[i].c0;
-        int c01 = s_fourElement[i].c1;
-        int c012 = s_fourElement[i].c2;
-
-        Vector3 x0 = x_sat[c0];
-        //float w0 = w_sat[c0];
+    const __m256i byte_mask = _mm256_set1_epi32(0xFF);
+    const __m256i zero = _mm256_setzero_si256();
 
-        Vector3 x1 = x_sat[c01] - x_sat[c0];
-        //float w1 = w_sat[c01] - w_sat[c0];
+    __m256 vbesterror_lo = _mm256_set1_ps(FLT_MAX);
+    __m256 vbesterror_hi = _mm256_set1_ps(FLT_MAX);
+    __m256i vbeststart[3] = { zero, zero, zero };
+    __m256i vbestend[3] = { zero, zero, zero };
 
-        Vector3 x2 = x_sat[c012] - x_sat[c01];
-        //float w2 = w_sat[c012] - w_sat[c01];
+    // check all possible clusters for this total order
+    const int total_order_count = s_fourClusterTotal[count - 1];
 
-        float const alpha2_sum = s_fourElement[i].alpha2_sum;
-        float const beta2_sum = s_fourElement[i].beta2_sum;
-        float const alphabeta_sum = s_fourElement[i].alphabeta_sum;
-        float const factor = s_fourElement[i].factor;
+    for (int i = 0; i < total_order_count; i += 16)
+    {
+        // Unpack the cluster boundaries to 16 bit lanes. The order of the lanes doesn't matter, the entries past the total
+        // reference the last SAT entry and repeat other configurations.
+        __m256i packed0 = _mm256_load_si256((const __m256i *)&s_fourCluster[i]);
+        __m256i packed1 = _mm256_load_si256((const __m256i *)&s_fourCluster[i + 8]);
+
+        __m256i c0 = _mm256_packus_epi32(_mm256_and_si256(packed0, byte_mask), _mm256_and_si256(packed1, byte_mask));
+        __m256i c1 = _mm256_packus_epi32(_mm256_and_si256(_mm256_srli_epi32(packed0, 8), byte_mask), _mm256_and_si256(_mm256_srli_epi32(packed1, 8), byte_mask));
+        __m256i c2 = _mm256_packus_epi32(_mm256_srli_epi32(packed0, 16), _mm256_srli_epi32(packed1, 16));
+        c2 = _mm256_and_si256(c2, _mm256_set1_epi16(0xFF));
+
+        __m256i lo0, hi0, lo1, hi1, lo2, hi2;
+        sat_indices16(c0, &lo0, &hi0);
+        sat_indices16(c1, &lo1, &hi1);
+        sat_indices16(c2, &lo2, &hi2);
+
+        __m256i w0 = _mm256_shuffle_epi8(w_table, lo0);
+        __m256i w1 = _mm256_shuffle_epi8(w_table, lo1);
+        __m256i w2 = _mm256_shuffle_epi8(w_table, lo2);
+        __m256i w3 = _mm256_sub_epi16(w_sum, w2);
+        w2 = _mm256_sub_epi16(w2, w1);
+        w1 = _mm256_sub_epi16(w1, w0);
+
+        // 9 times the alpha2, beta2 and alphabeta sums of the float version.
+        __m256i alpha2_sum = _mm256_add_epi16(_mm256_add_epi16(_mm256_mullo_epi16(w0, _mm256_set1_epi16(9)), _mm256_slli_epi16(w1, 2)), w2);
+        __m256i beta2_sum = _mm256_add_epi16(_mm256_add_epi16(_mm256_mullo_epi16(w3, _mm256_set1_epi16(9)), _mm256_slli_epi16(w2, 2)), w1);
+        __m256i alphabeta_sum = _mm256_slli_epi16(_mm256_add_epi16(w1, w2), 1);
+        __m256i neg_alphabeta_sum = _mm256_sub_epi16(zero, alphabeta_sum);
+
+        // The 32 bit results of madd hold lanes 0-3 and 8-11 in the lo half, and lanes 4-7 and 12-15 in the hi half.
+        __m256i beta2_lo = _mm256_unpacklo_epi16(beta2_sum, neg_alphabeta_sum);
+        __m256i beta2_hi = _mm256_unpackhi_epi16(beta2_sum, neg_alphabeta_sum);
+        __m256i alpha2_lo = _mm256_unpacklo_epi16(neg_alphabeta_sum, alpha2_sum);
+        __m256i alpha2_hi = _mm256_unpackhi_epi16(neg_alphabeta_sum, alpha2_sum);
+
+        __m256 den_lo = _mm256_cvtepi32_ps(_mm256_madd_epi16(_mm256_unpacklo_epi16(alpha2_sum, alphabeta_sum), beta2_lo));
+        __m256 den_hi = _mm256_cvtepi32_ps(_mm256_madd_epi16(_mm256_unpackhi_epi16(alpha2_sum, alphabeta_sum), beta2_hi));
+        __m256 factor_lo = _mm256_div_ps(_mm256_set1_ps(1.0f / 85.0f), den_lo);
+        __m256 factor_hi = _mm256_div_ps(_mm256_set1_ps(1.0f / 85.0f), den_hi);
+
+        __m256 error_lo = _mm256_setzero_ps();
+        __m256 error_hi = _mm256_setzero_ps();
+        __m256i a[3], b[3];
+
+        for (int c = 0; c < 3; c++) {
+            __m256i x0 = lookup_sat16(lo_table[c], hi_table[c], lo0, hi0);
+            __m256i x1 = lookup_sat16(lo_table[c], hi_table[c], lo1, hi1);
+            __m256i x2 = lookup_sat16(lo_table[c], hi_table[c], lo2, hi2);
+
+            // 3 times the alphax and betax sums.
+            __m256i alphax_sum = _mm256_add_epi16(_mm256_add_epi16(x0, x1), x2);
+            __m256i betax_sum = _mm256_sub_epi16(sum3[c], alphax_sum);
+            __m256i x_lo = _mm256_unpacklo_epi16(alphax_sum, betax_sum);
+            __m256i x_hi = _mm256_unpackhi_epi16(alphax_sum, betax_sum);
+
+            __m256 scale_lo = _mm256_mul_ps(factor_lo, _mm256_set1_ps(q_scale[c]));
+            __m256 scale_hi = _mm256_mul_ps(factor_hi, _mm256_set1_ps(q_scale[c]));
+
+            // Solve and clamp to the grid.
+            __m256i a_lo = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_madd_epi16(x_lo, beta2_lo)), scale_lo));
+            __m256i a_hi = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_madd_epi16(x_hi, beta2_hi)), scale_hi));
+            __m256i b_lo = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_madd_epi16(x_lo, alpha2_lo)), scale_lo));
+            __m256i b_hi = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_madd_epi16(x_hi, alpha2_hi)), scale_hi));
+            a[c] = _mm256_min_epi16(_mm256_max_epi16(_mm256_packs_epi32(a_lo, a_hi), zero), q_max[c]);
+            b[c] = _mm256_min_epi16(_mm256_max_epi16(_mm256_packs_epi32(b_lo, b_hi), zero), q_max[c]);
 
-        Vector3 const alphax_sum = x0 + x1 * (2.0f / 3.0f) + x2 * (1.0f / 3.0f);
-        Vector3 const betax_sum = m_xsum - alphax_sum;
+            // compute the error
+            __m256i u = _mm256_add_epi16(_mm256_mullo_epi16(a[c], alpha2_sum), _mm256_mullo_epi16(b[c], alphabeta_sum));
+            __m256i v = _mm256_add_epi16(_mm256_mullo_epi16(b[c], beta2_sum), _mm256_mullo_epi16(a[c], alphabeta_sum));
+            __m256i ab_lo = _mm256_unpacklo_epi16(a[c], b[c]);
+            __m256i ab_hi = _mm256_unpackhi_epi16(a[c], b[c]);
 
-        Vector3 a = (alphax_sum * beta2_sum - betax_sum * alphabeta_sum) * factor;
-        Vector3 b = (betax_sum * alpha2_sum - alphax_sum * alphabeta_sum) * factor;
+            __m256 t1_lo = _mm256_cvtepi32_ps(_mm256_madd_epi16(ab_lo, _mm256_unpacklo_epi16(u, v)));
+            __m256 t1_hi = _mm256_cvtepi32_ps(_mm256_madd_epi16(ab_hi, _mm256_unpackhi_epi16(u, v)));
+            __m256 t2_lo = _mm256_cvtepi32_ps(_mm256_madd_epi16(ab_lo, x_lo));
+            __m256 t2_hi = _mm256_cvtepi32_ps(_mm256_madd_epi16(ab_hi, x_hi));
 
-        // clamp to the grid
-        a = saturate(a);
-        b = saturate(b);
-#if ICBC_PERFECT_ROUND
-        a = round565(a);
-        b = round565(b);
-#else
-        a = round(grid * a) * gridrcp;
-        b = round(grid * b) * gridrcp;
-#endif
-        // @@ It would be much more accurate to evaluate the error exactly. 
+            // apply the metric to the error term
+            error_lo = _mm256_fmadd_ps(t1_lo, k1[c], _mm256_fnmadd_ps(t2_lo, k2[c], error_lo));
+            error_hi = _mm256_fmadd_ps(t1_hi, k1[c], _mm256_fnmadd_ps(t2_hi, k2[c], error_hi));
+        }
 
-        // compute the error
-        Vector3 e1 = a * a*alpha2_sum + b * b*beta2_sum +2.0f*(a*b*alphabeta_sum - a * alphax_sum - b * betax_sum);
+        // keep the solution if it wins
+        __m256 mask_lo = _mm256_cmp_ps(error_lo, vbesterror_lo, _CMP_LT_OQ);
+        __m256 mask_hi = _mm256_cmp_ps(error_hi, vbesterror_hi, _CMP_LT_OQ);
+        vbesterror_lo = _mm256_blendv_ps(vbesterror_lo, error_lo, mask_lo);
+        vbesterror_hi = _mm256_blendv_ps(vbesterror_hi, error_hi, mask_hi);
+
+        __m256i mask = _mm256_packs_epi32(_mm256_castps_si256(mask_lo), _mm256_castps_si256(mask_hi));
+        for (int c = 0; c < 3; c++) {
+            vbeststart[c] = _mm256_blendv_epi8(vbeststart[c], a[c], mask);
+            vbestend[c] = _mm256_blendv_epi8(vbestend[c], b[c], mask);
+        }
+    }
 
-        // apply the metric to the error term
-        float error = dot(e1, m_metricSqr);
+    ICBC_ALIGN_64 float besterrors[16];
+    ICBC_ALIGN_64 uint16 beststart[3][16];
+    ICBC_ALIGN_64 uint16 bestend[3][16];
+    _mm256_store_ps(besterrors + 0, vbesterror_lo);
+    _mm256_store_ps(besterrors + 8, vbesterror_hi);
+    for (int c = 0; c < 3; c++) {
+        _mm256_store_si256((__m256i *)beststart[c], vbeststart[c]);
+        _mm256_store_si256((__m256i *)bestend[c], vbestend[c]);
+    }
 
-        // keep the solution if it wins
-        if (error < besterror)
-        {
+    float besterror = FLT_MAX;
+    int bestindex = 0;
+    for (int i = 0; i < 16; i++) {
+        // Float lane of the 16 bit lane i.
+        float error = besterrors[(i & 3) + (i & 4) * 2 + (i & 8) / 2];
+        if (error < besterror) {
             besterror = error;
-            beststart = a;
-            bestend = b;
+            bestindex = i;
         }
     }
-#endif
 
-    *start = beststart;
-    *end = bestend;
+    start->x = beststart[0][bestindex] * (1.0f / 31.0f);
+    start->y = beststart[1][bestindex] * (1.0f / 63.0f);
+    start->z = beststart[2][bestindex] * (1.0f / 31.0f);
+    end->x = bestend[0][bestindex] * (1.0f / 31.0f);
+    end->y = bestend[1][bestindex] * (1.0f / 63.0f);
+    end->z = bestend[2][bestindex] * (1.0f / 31.0f);
+
+    return true;
 }
-#endif // ICBC_FAST_CLUSTER_FIT
 
+#endif // ICBC_USE_SPMD == ICBC_AVX2 || ICBC_USE_SPMD == ICBC_AVX512VL
 
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
@@ -2550,16 +3686,16 @@ static float evaluate_mse(const Vector3 & p, const Vector3 & c, const Vector3 &
     return dot(d, d);
 }
 
-static float evaluate_mse(const Color32 & p, const Vector3 & c, const Vector3 & w) {
-    Vector3 d = (color_to_vector3(p) - c) * w * 255;
-    return dot(d, d);
-}
-
 
 /*static float evaluate_mse(const Vector3 & p, const Vector3 & c, const Vector3 & w) {
     return ww.x * square(p.x-c.x) + ww.y * square(p.y-c.y) + ww.z * square(p.z-c.z);
 }*/
 
+static float evaluate_mse(const Color32 & p, const Color8 & c, const Vector3 & w) {
+    Vector3 d = { float(int(p.r) - c.r) * w.x, float(int(p.g) - c.g) * w.y, float(int(p.b) - c.b) * w.z };
+    return dot(d, d);
+}
+
 static int evaluate_mse(const Color32 & p, const Color32 & c) {
     return (square(int(p.r)-c.r) + square(int(p.g)-c.g) + square(int(p.b)-c.b));
 }
@@ -2609,19 +3745,6 @@ static float evaluate_palette_error(Color32 palette[4], const Color32 * colors,
     return total;
 }
 
-static float evaluate_mse(const Vector4 input_colors[16], const float input_weights[16], const Vector3 & color_weights, const BlockDXT1 * output) {
-    Color32 palette[4];
-    evaluate_palette(output->col0, output->col1, palette);
-
-    // evaluate error for each index.
-    float error = 0.0f;
-    for (int i = 0; i < 16; i++) {
-        int index = (output->indices >> (2 * i)) & 3;
-        error += input_weights[i] * evaluate_mse(palette[index], input_colors[i].xyz, color_weights);
-    }
-    return error;
-}
-
 float evaluate_dxt1_error(const uint8 rgba_block[16*4], const BlockDXT1 * block, Decoder decoder) {
     Color32 palette[4];
     if (decoder == Decoder_NVIDIA) {
@@ -2652,108 +3775,303 @@ float evaluate_dxt1_error(const uint8 rgba_block[16*4], const BlockDXT1 * block,
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 // Index selection
 
-static uint compute_indices4(const Vector4 input_colors[16], const Vector3 & color_weights, const Vector3 palette[4]) {
-    
-    uint indices = 0;
+// The distances to the palette entries are evaluated VEC_SIZE texels at a time, and the 2 bit indices are built from the lane
+// masks of the comparisons. Colors are in SoA layout, 16 floats per channel, and both colors and palette are already scaled
+// by the color weights.
+static void load_colors_soa(const Vector4 input_colors[16], const Vector3 & color_weights, float colors[3 * 16]) {
+    const Vector3 w = color_weights * 255;
+    for (int i = 0; i < 16; i++) {
+        colors[i + 0] = input_colors[i].x * w.x;
+        colors[i + 16] = input_colors[i].y * w.y;
+        colors[i + 32] = input_colors[i].z * w.z;
+    }
+}
+
+static void load_colors_soa(const Vector3 input_colors[16], float colors[3 * 16]) {
     for (int i = 0; i < 16; i++) {
-        float d0 = evaluate_mse(palette[0], input_colors[i].xyz, color_weights);
-        float d1 = evaluate_mse(palette[1], input_colors[i].xyz, color_weights);
-        float d2 = evaluate_mse(palette[2], input_colors[i].xyz, color_weights);
-        float d3 = evaluate_mse(palette[3], input_colors[i].xyz, color_weights);
+        colors[i + 0] = input_colors[i].x * 255;
+        colors[i + 16] = input_colors[i].y * 255;
+        colors[i + 32] = input_colors[i].z * 255;
+    }
+}
 
-        uint b0 = d0 > d3;
-        uint b1 = d1 > d2;
-        uint b2 = d0 > d2;
-        uint b3 = d1 > d3;
-        uint b4 = d2 > d3;
+static void load_colors_soa(const Color8 input_colors[16], const Vector3 & color_weights, float colors[3 * 16]) {
+    for (int i = 0; i < 16; i++) {
+        colors[i + 0] = float(input_colors[i].r) * color_weights.x;
+        colors[i + 16] = float(input_colors[i].g) * color_weights.y;
+        colors[i + 32] = float(input_colors[i].b) * color_weights.z;
+    }
+}
 
-        uint x0 = b1 & b2;
-        uint x1 = b0 & b3;
-        uint x2 = b0 & b4;
+// The palette is converted back to 8 bits, so that the distances to the input colors are computed from integer differences.
+static void weight_palette(const Color8 *, const Vector3 & color_weights, const Vector3 palette[4], Vector3 output[4]) {
+    for (int i = 0; i < 4; i++) {
+        Color32 c = vector3_to_color32(palette[i]);
+        output[i] = { float(c.r) * color_weights.x, float(c.g) * color_weights.y, float(c.b) * color_weights.z };
+    }
+}
 
-        indices |= (x2 | ((x0 | x1) << 1)) << (2 * i);
+static void weight_palette(const Vector4 *, const Vector3 & color_weights, const Vector3 palette[4], Vector3 output[4]) {
+    for (int i = 0; i < 4; i++) {
+        output[i] = palette[i] * color_weights * 255;
     }
+}
 
-    return indices;
+// Spread the 16 bits of lsb and msb to the even and odd bits of the result.
+inline uint interleave_bits(uint lsb, uint msb) {
+    uint x = lsb | (msb << 16);
+    x = (x & 0xFF0000FF) | ((x & 0x00FF0000) >> 8) | ((x & 0x0000FF00) << 8);
+    x = (x & 0xF00FF00F) | ((x & 0x0F000F00) >> 4) | ((x & 0x00F000F0) << 4);
+    x = (x & 0xC3C3C3C3) | ((x & 0x30303030) >> 2) | ((x & 0x0C0C0C0C) << 2);
+    x = (x & 0x99999999) | ((x & 0x44444444) >> 1) | ((x & 0x22222222) << 1);
+    return x;
 }
 
+static uint vcompute_indices4(const float colors[3 * 16], const Vector3 palette[4]) {
 
-static uint compute_indices4(const Vector3 input_colors[16], const Vector3 palette[4]) {
+    const VVector3 p0 = vbroadcast(palette[0]);
+    const VVector3 p1 = vbroadcast(palette[1]);
+    const VVector3 p2 = vbroadcast(palette[2]);
+    const VVector3 p3 = vbroadcast(palette[3]);
 
-    uint indices = 0;
-    for (int i = 0; i < 16; i++) {
-        float d0 = evaluate_mse(palette[0], input_colors[i], {1,1,1});
-        float d1 = evaluate_mse(palette[1], input_colors[i], {1,1,1});
-        float d2 = evaluate_mse(palette[2], input_colors[i], {1,1,1});
-        float d3 = evaluate_mse(palette[3], input_colors[i], {1,1,1});
+    uint lsb = 0, msb = 0;
+    for (int i = 0; i < 16; i += VEC_SIZE) {
+        VVector3 c = { vload(colors + i), vload(colors + 16 + i), vload(colors + 32 + i) };
 
-        uint b0 = d0 > d3;
-        uint b1 = d1 > d2;
-        uint b2 = d0 > d2;
-        uint b3 = d1 > d3;
-        uint b4 = d2 > d3;
+        VVector3 t0 = c - p0;
+        VVector3 t1 = c - p1;
+        VVector3 t2 = c - p2;
+        VVector3 t3 = c - p3;
 
-        uint x0 = b1 & b2;
-        uint x1 = b0 & b3;
-        uint x2 = b0 & b4;
+        VFloat d0 = vdot(t0, t0);
+        VFloat d1 = vdot(t1, t1);
+        VFloat d2 = vdot(t2, t2);
+        VFloat d3 = vdot(t3, t3);
 
-        indices |= (x2 | ((x0 | x1) << 1)) << (2 * i);
+        VMask b0 = d0 > d3;
+        VMask b1 = d1 > d2;
+        VMask b2 = d0 > d2;
+        VMask b3 = d1 > d3;
+        VMask b4 = d2 > d3;
+
+        lsb |= mask_bits(b0 & b4) << i;
+        msb |= mask_bits((b1 & b2) | (b0 & b3)) << i;
     }
 
-    return indices;
+    return interleave_bits(lsb, msb);
 }
 
+// Same as above for the 3 color palette, the closest entry is selected, the last one on ties.
+static uint vcompute_indices(const float colors[3 * 16], const Vector3 palette[4]) {
 
-static uint compute_indices(const Vector4 input_colors[16], const Vector3 & color_weights, const Vector3 palette[4]) {
-    
-    uint indices = 0;
-    for (int i = 0; i < 16; i++) {
-        float d0 = evaluate_mse(palette[0], input_colors[i].xyz, color_weights);
-        float d1 = evaluate_mse(palette[1], input_colors[i].xyz, color_weights);
-        float d2 = evaluate_mse(palette[2], input_colors[i].xyz, color_weights);
-        float d3 = evaluate_mse(palette[3], input_colors[i].xyz, color_weights);
-
-        uint index;
-        if (d0 < d1 && d0 < d2 && d0 < d3) index = 0;
-        else if (d1 < d2 && d1 < d3) index = 1;
-        else if (d2 < d3) index = 2;
-        else index = 3;
+    const VVector3 p0 = vbroadcast(palette[0]);
+    const VVector3 p1 = vbroadcast(palette[1]);
+    const VVector3 p2 = vbroadcast(palette[2]);
+    const VVector3 p3 = vbroadcast(palette[3]);
 
-		indices |= index << (2 * i);
-	}
+    uint lsb = 0, msb = 0;
+    for (int i = 0; i < 16; i += VEC_SIZE) {
+        VVector3 c = { vload(colors + i), vload(colors + 16 + i), vload(colors + 32 + i) };
 
-	return indices;
-}
+        VVector3 t0 = c - p0;
+        VVector3 t1 = c - p1;
+        VVector3 t2 = c - p2;
+        VVector3 t3 = c - p3;
 
+        VFloat d0 = vdot(t0, t0);
+        VFloat d1 = vdot(t1, t1);
+        VFloat d2 = vdot(t2, t2);
+        VFloat d3 = vdot(t3, t3);
 
-static void output_block3(const Vector4 input_colors[16], const Vector3 & color_weights, const Vector3 & v0, const Vector3 & v1, BlockDXT1 * block)
-{
-    Color16 color0 = vector3_to_color16(v0);
-    Color16 color1 = vector3_to_color16(v1);
+        uint m0 = mask_bits((d0 < d1) & (d0 < d2) & (d0 < d3));
+        uint m1 = mask_bits((d1 < d2) & (d1 < d3)) & ~m0;
+        uint m2 = mask_bits(d2 < d3) & ~(m0 | m1);
+        uint m3 = ~(m0 | m1 | m2);
 
-    if (color0.u > color1.u) {
-        swap(color0, color1);
+        lsb |= ((m1 | m3) & ((1 << VEC_SIZE) - 1)) << i;
+        msb |= ((m2 | m3) & ((1 << VEC_SIZE) - 1)) << i;
     }
 
-    Vector3 palette[4];
-    evaluate_palette(color0, color1, palette);
+    return interleave_bits(lsb, msb);
+}
 
-    block->col0 = color0;
-    block->col1 = color1;
-    block->indices = compute_indices(input_colors, color_weights, palette);
+template <typename InputColor>
+static uint compute_indices4(const InputColor input_colors[16], const Vector3 & color_weights, const Vector3 palette[4]) {
+    ICBC_ALIGN_64 float colors[3 * 16];
+    load_colors_soa(input_colors, color_weights, colors);
+
+    Vector3 weighted_palette[4];
+    weight_palette(input_colors, color_weights, palette, weighted_palette);
+
+    return vcompute_indices4(colors, weighted_palette);
 }
 
-static void output_block4(const Vector4 input_colors[16], const Vector3 & color_weights, const Vector3 & v0, const Vector3 & v1, BlockDXT1 * block)
-{
-    Color16 color0 = vector3_to_color16(v0);
-    Color16 color1 = vector3_to_color16(v1);
+static uint compute_indices4(const Vector3 input_colors[16], const Vector3 palette[4]) {
+    ICBC_ALIGN_64 float colors[3 * 16];
+    load_colors_soa(input_colors, colors);
 
-    if (color0.u < color1.u) {
-        swap(color0, color1);
+    Vector3 scaled_palette[4];
+    for (int i = 0; i < 4; i++) {
+        scaled_palette[i] = palette[i] * 255;
     }
 
-    Vector3 palette[4];
-    evaluate_palette(color0, color1, palette);
+    return vcompute_indices4(colors, scaled_palette);
+}
+
+template <typename InputColor>
+static uint compute_indices(const InputColor input_colors[16], const Vector3 & color_weights, const Vector3 palette[4]) {
+    ICBC_ALIGN_64 float colors[3 * 16];
+    load_colors_soa(input_colors, color_weights, colors);
+
+    Vector3 weighted_palette[4];
+    weight_palette(input_colors, color_weights, palette, weighted_palette);
+
+    return vcompute_indices(colors, weighted_palette);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// Block error evaluation
+
+// Input texels in SoA layout, scaled by the color weights, and their weights. Loaded once per block and shared by all the
+// error evaluations of the candidate blocks.
+struct BlockColors {
+    ICBC_ALIGN_64 float colors[3 * 16];
+    ICBC_ALIGN_64 float weights[16];
+    Vector3 color_weights;
+};
+
+// Float colors are scaled to the [0-255] range, so that the palette is weighted the same way for both input types.
+template <typename InputColor>
+static void load_block_colors(const InputColor input_colors[16], const float input_weights[16], const Vector3 & color_weights, BlockColors * block) {
+    load_colors_soa(input_colors, color_weights, block->colors);
+    for (int i = 0; i < 16; i++) {
+        block->weights[i] = input_weights[i];
+    }
+    block->color_weights = color_weights;
+}
+
+// Inverse of interleave_bits, the even bits of x are returned in the low half and the odd bits in the high half.
+inline uint deinterleave_bits(uint x) {
+    x = (x & 0x99999999) | ((x & 0x44444444) >> 1) | ((x & 0x22222222) << 1);
+    x = (x & 0xC3C3C3C3) | ((x & 0x30303030) >> 2) | ((x & 0x0C0C0C0C) << 2);
+    x = (x & 0xF00FF00F) | ((x & 0x0F000F00) >> 4) | ((x & 0x00F000F0) << 4);
+    x = (x & 0xFF0000FF) | ((x & 0x00FF0000) >> 8) | ((x & 0x0000FF00) << 8);
+    return x;
+}
+
+static void weight_palette(const BlockColors & block, const BlockDXT1 * output, Vector3 palette[4]) {
+    Color32 palette32[4];
+    evaluate_palette(output->col0, output->col1, palette32);
+
+    const Vector3 & w = block.color_weights;
+    for (int i = 0; i < 4; i++) {
+        palette[i] = { float(palette32[i].r) * w.x, float(palette32[i].g) * w.y, float(palette32[i].b) * w.z };
+    }
+}
+
+// Scores count candidate blocks against the same texels, VEC_SIZE texels at a time. The palette entry of each lane is
+// selected with the masks of its two index bits. Float colors are weighted before the palette is subtracted, and the lanes are
+// summed in a different order than a texel by texel loop, so the errors of float inputs differ in the last bits from that
+// evaluation, and blocks whose candidates are within rounding of each other can be encoded differently.
+static void vevaluate_mse(const BlockColors & block, const Vector3 palettes[][4], const uint * indices, int count, float * errors) {
+
+    for (int k = 0; k < count; k++) {
+#if ICBC_USE_SPMD == ICBC_FLOAT
+        // Masks would turn into unpredictable branches, index the palette instead.
+        float error = 0.0f;
+        for (int i = 0; i < 16; i++) {
+            Vector3 c = { block.colors[i], block.colors[16 + i], block.colors[32 + i] };
+            Vector3 d = c - palettes[k][(indices[k] >> (2 * i)) & 3];
+            error += block.weights[i] * dot(d, d);
+        }
+        errors[k] = error;
+#else
+        const uint bits = deinterleave_bits(indices[k]);
+
+        const VVector3 p0 = vbroadcast(palettes[k][0]);
+        const VVector3 p1 = vbroadcast(palettes[k][1]);
+        const VVector3 p2 = vbroadcast(palettes[k][2]);
+        const VVector3 p3 = vbroadcast(palettes[k][3]);
+
+        VFloat error = vzero();
+        for (int i = 0; i < 16; i += VEC_SIZE) {
+            VVector3 c = { vload(block.colors + i), vload(block.colors + 16 + i), vload(block.colors + 32 + i) };
+            VFloat w = vload(block.weights + i);
+
+            VMask lsb = vmask(bits >> i);
+            VMask msb = vmask(bits >> (16 + i));
+
+            VVector3 d = c - vselect(msb, vselect(lsb, p0, p1), vselect(lsb, p2, p3));
+            error = vmad(w, vdot(d, d), error);
+        }
+        errors[k] = vreduce_add(error);
+#endif
+    }
+}
+
+// Returns the weighted MSE error in [0-255] range.
+static float evaluate_mse(const BlockColors & block, const BlockDXT1 * output) {
+    Vector3 palette[1][4];
+    weight_palette(block, output, palette[0]);
+
+    float error;
+    vevaluate_mse(block, palette, &output->indices, 1, &error);
+    return error;
+}
+
+// Up to 8 candidates are evaluated at once.
+static void evaluate_mse(const BlockColors & block, const BlockDXT1 * candidates, int count, float * errors) {
+    ICBC_ASSERT(count <= 8);
+
+    Vector3 palettes[8][4];
+    uint indices[8];
+    for (int k = 0; k < count; k++) {
+        weight_palette(block, candidates + k, palettes[k]);
+        indices[k] = candidates[k].indices;
+    }
+
+    vevaluate_mse(block, palettes, indices, count, errors);
+}
+
+template <typename InputColor>
+static float evaluate_mse(const InputColor input_colors[16], const float input_weights[16], const Vector3 & color_weights, const BlockDXT1 * output) {
+    BlockColors block;
+    load_block_colors(input_colors, input_weights, color_weights, &block);
+    return evaluate_mse(block, output);
+}
+
+
+template <typename InputColor>
+static void output_block3(const InputColor input_colors[16], const Vector3 & color_weights, const Vector3 & v0, const Vector3 & v1, BlockDXT1 * block)
+{
+    Color16 color0 = vector3_to_color16(v0);
+    Color16 color1 = vector3_to_color16(v1);
+
+    if (color0.u > color1.u) {
+        swap(color0, color1);
+    }
+
+    Vector3 palette[4];
+    evaluate_palette(color0, color1, palette);
+
+    block->col0 = color0;
+    block->col1 = color1;
+    block->indices = compute_indices(input_colors, color_weights, palette);
+}
+
+template <typename InputColor>
+static void output_block4(const InputColor input_colors[16], const Vector3 & color_weights, const Vector3 & v0, const Vector3 & v1, BlockDXT1 * block)
+{
+    Color16 color0 = vector3_to_color16(v0);
+    Color16 color1 = vector3_to_color16(v1);
+
+    if (color0.u < color1.u) {
+        swap(color0, color1);
+    }
+
+    Vector3 palette[4];
+    evaluate_palette(color0, color1, palette);
 
     block->col0 = color0;
     block->col1 = color1;
@@ -2813,6 +4131,55 @@ static bool optimize_end_points4(uint indices, const Vector4 * colors, /*const f
     return true;
 }
 
+// Least squares fitting of 8 bit colors using integer sums. The factors are scaled by 3 so that they are integers too.
+static bool optimize_end_points4(uint indices, const Color8 * colors, int count, Vector3 * a, Vector3 * b)
+{
+    static const int factors[4] = { 3, 0, 2, 1 };
+
+    int alpha2_sum = 0;
+    int beta2_sum = 0;
+    int alphabeta_sum = 0;
+    int alphax_sum[3] = { 0, 0, 0 };
+    int betax_sum[3] = { 0, 0, 0 };
+
+    for (int i = 0; i < count; i++)
+    {
+        const uint idx = (indices >> (2 * i)) & 3;
+        int alpha = factors[idx];
+        int beta = 3 - alpha;
+
+        alpha2_sum += alpha * alpha;
+        beta2_sum += beta * beta;
+        alphabeta_sum += alpha * beta;
+        alphax_sum[0] += alpha * colors[i].r;
+        alphax_sum[1] += alpha * colors[i].g;
+        alphax_sum[2] += alpha * colors[i].b;
+        betax_sum[0] += beta * colors[i].r;
+        betax_sum[1] += beta * colors[i].g;
+        betax_sum[2] += beta * colors[i].b;
+    }
+
+    // The denominator is 81 times the one of the float version, any non zero value is above the equal(denom, 0.0f) threshold.
+    int denom = alpha2_sum * beta2_sum - alphabeta_sum * alphabeta_sum;
+    if (denom == 0) return false;
+
+    // Undo the factor and color scales.
+    float factor = 3.0f / (255.0f * denom);
+
+    Vector3 va, vb;
+    va.x = float(alphax_sum[0] * beta2_sum - betax_sum[0] * alphabeta_sum);
+    va.y = float(alphax_sum[1] * beta2_sum - betax_sum[1] * alphabeta_sum);
+    va.z = float(alphax_sum[2] * beta2_sum - betax_sum[2] * alphabeta_sum);
+    vb.x = float(betax_sum[0] * alpha2_sum - alphax_sum[0] * alphabeta_sum);
+    vb.y = float(betax_sum[1] * alpha2_sum - alphax_sum[1] * alphabeta_sum);
+    vb.z = float(betax_sum[2] * alpha2_sum - alphax_sum[2] * alphabeta_sum);
+
+    *a = saturate(va * factor);
+    *b = saturate(vb * factor);
+
+    return true;
+}
+
 // Least squares optimization with custom factors.
 // This allows us passing the standard [1, 0, 2/3 1/3] weights by default, but also use alternative mappings when the number of clusters is not 4.
 static bool optimize_end_points4(uint indices, const Vector3 * colors, int count, float factors[4], Vector3 * a, Vector3 * b)
@@ -2999,6 +4366,8 @@ static void init_dxt1_tables()
 
     PrepareOptTable(&s_match5[0][0], expand5, 32);
     PrepareOptTable(&s_match6[0][0], expand6, 64);
+
+    for (int i = 0; i < 256; i++) s_unorm8_to_float[i] = i / 255.0f;
 }
 
 // Single color compressor, based on:
@@ -3020,6 +4389,16 @@ static void compress_dxt1_single_color_optimal(Color32 c, BlockDXT1 * output)
     }
 }
 
+static void compress_dxt1_single_color_optimal(Color8 c, BlockDXT1 * output)
+{
+    Color32 c32;
+    c32.r = c.r;
+    c32.g = c.g;
+    c32.b = c.b;
+    c32.a = 255;
+    compress_dxt1_single_color_optimal(c32, output);
+}
+
 
 // Compress block using the average color.
 static float compress_dxt1_single_color(const Vector3 * colors, const float * weights, int count, const Vector3 & color_weights, BlockDXT1 * output)
@@ -3050,28 +4429,34 @@ static float compress_dxt1_single_color(const Vector3 * colors, const float * we
     return error;
 }
 
-static float compress_dxt1_cluster_fit(const Vector4 input_colors[16], const float input_weights[16], const Vector3 * colors, const float * weights, int count, const Vector3 & color_weights, bool three_color_mode, bool use_transparent_black, BlockDXT1 * output)
+template <typename InputColor>
+static float compress_dxt1_cluster_fit(const InputColor input_colors[16], const BlockColors & block, const Vector3 * colors, const float * weights, int count, int max_count, const Vector3 & color_weights, bool three_color_mode, bool use_transparent_black, bool fixed_point, float max_error, BlockDXT1 * output)
 {
     Vector3 metric_sqr = color_weights * color_weights;
 
     SummedAreaTable sat;
-    int sat_count = compute_sat(colors, weights, count, &sat);
+    int sat_count = compute_sat(colors, weights, count, max_count, &sat);
 
     Vector3 start, end;
+#if ICBC_USE_SPMD == ICBC_AVX2 || ICBC_USE_SPMD == ICBC_AVX512VL
+    if (!fixed_point || !cluster_fit_four_fixed(sat, sat_count, metric_sqr, &start, &end))
+#else
+    (void)fixed_point;  // The fixed point kernel is only implemented with AVX2 integer ops.
+#endif
     cluster_fit_four(sat, sat_count, metric_sqr, &start, &end);
 
     output_block4(input_colors, color_weights, start, end, output);
 
-    float best_error = evaluate_mse(input_colors, input_weights, color_weights, output);
+    float best_error = evaluate_mse(block, output);
 
-    if (three_color_mode) {
+    if (three_color_mode && best_error > max_error) {
         if (use_transparent_black) {
             Vector3 tmp_colors[16];
             float tmp_weights[16];
             int tmp_count = skip_blacks(colors, weights, count, tmp_colors, tmp_weights);
             if (!tmp_count) return best_error;
 
-            sat_count = compute_sat(tmp_colors, tmp_weights, tmp_count, &sat);
+            sat_count = compute_sat(tmp_colors, tmp_weights, tmp_count, max_count, &sat);
         }
 
         cluster_fit_three(sat, sat_count, metric_sqr, &start, &end);
@@ -3079,7 +4464,7 @@ static float compress_dxt1_cluster_fit(const Vector4 input_colors[16], const flo
         BlockDXT1 three_color_block;
         output_block3(input_colors, color_weights, start, end, &three_color_block);
 
-        float three_color_error = evaluate_mse(input_colors, input_weights, color_weights, &three_color_block);
+        float three_color_error = evaluate_mse(block, &three_color_block);
 
         if (three_color_error < best_error) {
             best_error = three_color_error;
@@ -3132,9 +4517,38 @@ static float compress_dxt1_cluster_fit(const Vector4 input_colors[16], const flo
 }
 
 
-static float refine_endpoints(const Vector4 input_colors[16], const float input_weights[16], const Vector3 & color_weights, bool three_color_mode, float input_error, BlockDXT1 * output) {
+// Scores count candidate palettes, VEC_SIZE candidates at a time, selecting the closest palette entry for each texel. The
+// weighted palettes are in SoA layout, one row of candidates for each entry and channel.
+static void vevaluate_palettes(const BlockColors & block, const float palettes[12][32], int count, float errors[32]) {
+
+    for (int k = 0; k < count; k += VEC_SIZE) {
+        const VVector3 p0 = { vload(palettes[0] + k), vload(palettes[1] + k), vload(palettes[2] + k) };
+        const VVector3 p1 = { vload(palettes[3] + k), vload(palettes[4] + k), vload(palettes[5] + k) };
+        const VVector3 p2 = { vload(palettes[6] + k), vload(palettes[7] + k), vload(palettes[8] + k) };
+        const VVector3 p3 = { vload(palettes[9] + k), vload(palettes[10] + k), vload(palettes[11] + k) };
+
+        VFloat error = vzero();
+        for (int i = 0; i < 16; i++) {
+            const VVector3 c = { vbroadcast(block.colors[i]), vbroadcast(block.colors[16 + i]), vbroadcast(block.colors[32 + i]) };
+
+            VVector3 t0 = c - p0;
+            VVector3 t1 = c - p1;
+            VVector3 t2 = c - p2;
+            VVector3 t3 = c - p3;
+
+            VFloat d = vmin(vmin(vdot(t0, t0), vdot(t1, t1)), vmin(vdot(t2, t2), vdot(t3, t3)));
+            error = vmad(vbroadcast(block.weights[i]), d, error);
+        }
+        vstore(errors + k, error);
+    }
+}
+
+// Steepest descent: every step moves one endpoint by one of the deltas in the direction that reduces the error the most, and
+// stops at a local minimum. All the candidate moves are scored at once with the best indices for their palette, the indices
+// are only computed for the final endpoints.
+template <typename InputColor>
+static float refine_endpoints(const InputColor input_colors[16], const BlockColors & block, const Vector3 & color_weights, bool three_color_mode, int step_count, float max_error, float input_error, BlockDXT1 * output) {
     // TODO:
-    // - Optimize palette evaluation when updating only one channel.
     // - try all diagonals.
 
     // Things that don't help:
@@ -3169,50 +4583,88 @@ static float refine_endpoints(const Vector4 input_colors[16], const float input_
         {0,1,-1},
     };
 
+    BlockDXT1 best = *output;
     float best_error = input_error;
+    bool improved = false;
+
+    for (int step = 0; step < step_count; step++) {
+        BlockDXT1 candidates[32];
+        int count = 0;
+
+        for (int i = 0; i < 32; i++) {
+            const Color16 c = (i < 16) ? best.col1 : best.col0;
+            const int r = c.r + deltas[i % 16][0];
+            const int g = c.g + deltas[i % 16][1];
+            const int b = c.b + deltas[i % 16][2];
+            if (r < 0 || r > 31 || g < 0 || g > 63 || b < 0 || b > 31) continue;
+
+            BlockDXT1 refined = best;
+            Color16 & e = (i < 16) ? refined.col1 : refined.col0;
+            e.r = r;
+            e.g = g;
+            e.b = b;
+
+            if (!three_color_mode) {
+                if (refined.col0.u == refined.col1.u) refined.col1.g += 1;
+                if (refined.col0.u < refined.col1.u) swap(refined.col0.u, refined.col1.u);
+            }
 
-    int lastImprovement = 0;
-    for (int i = 0; i < 256; i++) {
-        BlockDXT1 refined = *output;
-        int8 delta[3] = { deltas[i % 16][0], deltas[i % 16][1], deltas[i % 16][2] };
+            candidates[count++] = refined;
+        }
 
-        if ((i / 16) & 1) {
-            refined.col0.r += delta[0];
-            refined.col0.g += delta[1];
-            refined.col0.b += delta[2];
+        ICBC_ALIGN_64 float palettes[12][32];
+        for (int k = 0; k < count; k++) {
+            Vector3 palette[4];
+            weight_palette(block, candidates + k, palette);
+            for (int j = 0; j < 4; j++) {
+                palettes[3 * j + 0][k] = palette[j].x;
+                palettes[3 * j + 1][k] = palette[j].y;
+                palettes[3 * j + 2][k] = palette[j].z;
+            }
         }
-        else {
-            refined.col1.r += delta[0];
-            refined.col1.g += delta[1];
-            refined.col1.b += delta[2];
+        for (int k = count; k < 32; k++) {
+            for (int j = 0; j < 12; j++) palettes[j][k] = 0.0f;
         }
 
-        if (!three_color_mode) {
-            if (refined.col0.u == refined.col1.u) refined.col1.g += 1;
-            if (refined.col0.u < refined.col1.u) swap(refined.col0.u, refined.col1.u);
+        ICBC_ALIGN_64 float errors[32];
+        vevaluate_palettes(block, palettes, count, errors);
+
+        int best_k = -1;
+        for (int k = 0; k < count; k++) {
+            if (errors[k] < best_error) {
+                best_error = errors[k];
+                best_k = k;
+            }
         }
+        if (best_k < 0) break;
 
-        Vector3 palette[4];
-        evaluate_palette(output->col0, output->col1, palette);
+        best = candidates[best_k];
+        improved = true;
 
-        refined.indices = compute_indices(input_colors, color_weights, palette);
+        if (best_error <= max_error) break;
+    }
 
-        float refined_error = evaluate_mse(input_colors, input_weights, color_weights, &refined);
-        if (refined_error < best_error) {
-            best_error = refined_error;
-            *output = refined;
-            lastImprovement = i;
-        }
+    if (!improved) return input_error;
 
-        // Early out if the last 32 steps didn't improve error.
-        if (i - lastImprovement > 32) break;
-    }
+    Vector3 palette[4];
+    evaluate_palette(best.col0, best.col1, palette);
+    best.indices = compute_indices(input_colors, color_weights, palette);
 
-    return best_error;
+    // The indices selected by compute_indices have the same error, up to rounding.
+    float error = evaluate_mse(block, &best);
+    if (error < input_error) {
+        *output = best;
+        return error;
+    }
+    return input_error;
 }
 
 
-static float compress_dxt1(const Vector4 input_colors[16], const float input_weights[16], const Vector3 & color_weights, bool three_color_mode, bool hq, BlockDXT1 * output)
+static const float s_unit_weights[16] = { 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1 };
+
+// InputColor is Vector4 for float blocks or Color8 for RGBA8 blocks. The block holds the same texels already loaded in SoA layout.
+template <typename InputColor>
+static float compress_dxt1(const InputColor input_colors[16], const float input_weights[16], const BlockColors & block, const Vector3 & color_weights, bool three_color_mode, Quality quality, float max_error, BlockDXT1 * output)
 {
     Vector3 colors[16];
     float weights[16];
@@ -3230,7 +4682,7 @@ static float compress_dxt1(const Vector4 input_colors[16], const float input_wei
     // Cluster fit cannot handle single color blocks, so encode them optimally.
     if (count == 1) {
         compress_dxt1_single_color_optimal(vector3_to_color32(colors[0]), output);
-        return evaluate_mse(input_colors, input_weights, color_weights, output);
+        return evaluate_mse(block, output);
     }
 
     // Quick end point selection.
@@ -3238,40 +4690,86 @@ static float compress_dxt1(const Vector4 input_colors[16], const float input_wei
     fit_colors_bbox(colors, count, &c0, &c1);
     inset_bbox(&c0, &c1);
     select_diagonal(colors, count, &c0, &c1);
-    output_block4(input_colors, color_weights, c0, c1, output);
 
-    float error = evaluate_mse(input_colors, input_weights, color_weights, output);
+    BlockDXT1 candidates[2];
+    output_block4(input_colors, color_weights, c0, c1, &candidates[0]);
+    *output = candidates[0];
 
-    // Refine color for the selected indices.
-    if (optimize_end_points4(output->indices, input_colors, 16, &c0, &c1)) {
-        BlockDXT1 optimized_block;
-        output_block4(input_colors, color_weights, c0, c1, &optimized_block);
+    // Refine color for the selected indices. Both blocks are scored in the same pass over the texels.
+    float error;
+    if (quality >= Quality_Level1 && optimize_end_points4(output->indices, input_colors, 16, &c0, &c1)) {
+        output_block4(input_colors, color_weights, c0, c1, &candidates[1]);
+
+        float errors[2];
+        evaluate_mse(block, candidates, 2, errors);
 
-        float optimized_error = evaluate_mse(input_colors, input_weights, color_weights, &optimized_block);
-        if (optimized_error < error) {
-            error = optimized_error;
-            *output = optimized_block;
+        error = errors[0];
+        if (error > max_error && errors[1] < error) {
+            error = errors[1];
+            *output = candidates[1];
         }
     }
+    else {
+        error = evaluate_mse(block, output);
+    }
+    if (error <= max_error) return error;
     //float error = FLT_MAX;
 
     // @@ Use current endpoints as input for initial PCA approximation?
 
-    // Try cluster fit.
-    BlockDXT1 cluster_fit_output;
-    float cluster_fit_error = compress_dxt1_cluster_fit(input_colors, input_weights, colors, weights, count, color_weights, three_color_mode, use_transparent_black, &cluster_fit_output);
-    if (cluster_fit_error < error) {
-        *output = cluster_fit_output;
-        error = cluster_fit_error;
+    // Try cluster fit. The lower levels merge similar colors to evaluate fewer cluster combinations.
+    if (quality >= Quality_Level2) {
+        int max_count = (quality == Quality_Level2) ? 8 : (quality == Quality_Level3) ? 12 : 16;
+        bool three_color_cluster_fit = three_color_mode && quality >= Quality_Level5;
+        bool fixed_point_cluster_fit = quality <= Quality_Level4;
+
+        BlockDXT1 cluster_fit_output;
+        float cluster_fit_error = compress_dxt1_cluster_fit(input_colors, block, colors, weights, count, max_count, color_weights, three_color_cluster_fit, use_transparent_black, fixed_point_cluster_fit, max_error, &cluster_fit_output);
+        if (cluster_fit_error < error) {
+            *output = cluster_fit_output;
+            error = cluster_fit_error;
+        }
+        if (error <= max_error) return error;
     }
 
-    if (hq) {
-        error = refine_endpoints(input_colors, input_weights, color_weights, three_color_mode, error, output);
+    if (quality >= Quality_Level6) {
+        int step_count = (quality == Quality_Level6) ? 8 : (quality == Quality_Level7) ? 16 : 256;
+        error = refine_endpoints(input_colors, block, color_weights, three_color_mode, step_count, max_error, error, output);
     }
 
     return error;
 }
 
+template <typename InputColor>
+static float compress_dxt1(const InputColor input_colors[16], const float input_weights[16], const Vector3 & color_weights, bool three_color_mode, Quality quality, float max_error, BlockDXT1 * output)
+{
+    BlockColors block;
+    load_block_colors(input_colors, input_weights, color_weights, &block);
+
+    return compress_dxt1(input_colors, input_weights, block, color_weights, three_color_mode, quality, max_error, output);
+}
+
+// Solid blocks are detected on the RGBA8 texels, before any float conversion, and encoded with the single color tables.
+static bool compress_dxt1_solid(const Color8 input_colors[16], const Vector3 & color_weights, BlockDXT1 * output, float * error)
+{
+    if (!is_single_color_rgba8((const uint8 *)input_colors)) return false;
+
+    compress_dxt1_single_color_optimal(input_colors[0], output);
+
+    Color32 palette[4];
+    evaluate_palette(output->col0, output->col1, palette);
+    *error = 16 * evaluate_mse(palette[output->indices & 3], input_colors[0], color_weights);
+    return true;
+}
+
+static float compress_dxt1(const Color8 input_colors[16], const Vector3 & color_weights, bool three_color_mode, Quality quality, float max_error, BlockDXT1 * output)
+{
+    float error;
+    if (compress_dxt1_solid(input_colors, color_weights, output, &error)) return error;
+
+    return compress_dxt1(input_colors, s_unit_weights, color_weights, three_color_mode, quality, max_error, output);
+}
+
 
 // 
 static bool centroid_end_points(uint indices, const Vector3 * colors, /*const float * weights,*/ float factor[4], Vector3 * c0, Vector3 * c1) {
@@ -3424,7 +4922,9 @@ static float compress_dxt1_test(const Vector4 input_colors[16], const float inpu
     }
 
     if (false) {
-        best_error = refine_endpoints(input_colors, input_weights, color_weights, false, best_error, output);
+        BlockColors block;
+        load_block_colors(input_colors, input_weights, color_weights, &block);
+        best_error = refine_endpoints(input_colors, block, color_weights, false, 256, 0.0f, best_error, output);
     }
 
     return best_error;
@@ -3470,6 +4970,11 @@ static float compress_dxt1_fast(const Vector4 input_colors[16], const float inpu
 
 static void compress_dxt1_fast(const uint8 input_colors[16*4], BlockDXT1 * output) {
 
+    if (is_single_color_rgba8(input_colors)) {
+        compress_dxt1_single_color_optimal(*(const Color8 *)input_colors, output);
+        return;
+    }
+
     Vector3 vec_colors[16];
     for (int i = 0; i < 16; i++) {
         vec_colors[i] = { input_colors[4 * i + 0] / 255.0f, input_colors[4 * i + 1] / 255.0f, input_colors[4 * i + 2] / 255.0f };
@@ -3494,42 +4999,1280 @@ static void compress_dxt1_fast(const uint8 input_colors[16*4], BlockDXT1 * outpu
     }
 }
 
-// Public API
 
-void init_dxt1() {
-    init_dxt1_tables();
-    init_cluster_tables();
-#if ICBC_FAST_CLUSTER_FIT
-    init_lsqr_tables();
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// Batched fast compressor. Encodes VEC_SIZE blocks at once, one block per lane.
+
+// Transpose VEC_SIZE consecutive 64 byte RGBA8 blocks so that texel i of each block is in a different lane. Colors are divided
+// by 255 as in compress_dxt1_fast, each channel is stored in VEC_SIZE consecutive floats.
+static void load_blocks_soa(const uint8 * blocks, float colors[16 * 3 * VEC_SIZE])
+{
+    for (int i = 0; i < 16; i++) {
+        float * r = colors + (3 * i + 0) * VEC_SIZE;
+        float * g = colors + (3 * i + 1) * VEC_SIZE;
+        float * b = colors + (3 * i + 2) * VEC_SIZE;
+#if ICBC_USE_SPMD == ICBC_AVX2 || ICBC_USE_SPMD == ICBC_AVX512VL
+        const __m256i offsets = _mm256_setr_epi32(0, 64, 128, 192, 256, 320, 384, 448);
+        const __m256i mask = _mm256_set1_epi32(0xFF);
+        const __m256 scale = _mm256_set1_ps(255.0f);
+        __m256i texel = _mm256_i32gather_epi32((const int *)(blocks + 4 * i), offsets, 1);
+        _mm256_store_ps(r, _mm256_div_ps(_mm256_cvtepi32_ps(_mm256_and_si256(texel, mask)), scale));
+        _mm256_store_ps(g, _mm256_div_ps(_mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(texel, 8), mask)), scale));
+        _mm256_store_ps(b, _mm256_div_ps(_mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(texel, 16), mask)), scale));
+#elif ICBC_USE_SPMD == ICBC_AVX512
+        const __m512i offsets = _mm512_setr_epi32(0, 64, 128, 192, 256, 320, 384, 448, 512, 576, 640, 704, 768, 832, 896, 960);
+        const __m512i mask = _mm512_set1_epi32(0xFF);
+        const __m512 scale = _mm512_set1_ps(255.0f);
+        __m512i texel = _mm512_i32gather_epi32(offsets, (const int *)(blocks + 4 * i), 1);
+        _mm512_store_ps(r, _mm512_div_ps(_mm512_cvtepi32_ps(_mm512_and_si512(texel, mask)), scale));
+        _mm512_store_ps(g, _mm512_div_ps(_mm512_cvtepi32_ps(_mm512_and_si512(_mm512_srli_epi32(texel, 8), mask)), scale));
+        _mm512_store_ps(b, _mm512_div_ps(_mm512_cvtepi32_ps(_mm512_and_si512(_mm512_srli_epi32(texel, 16), mask)), scale));
+#else
+        for (int l = 0; l < VEC_SIZE; l++) {
+            r[l] = blocks[64 * l + 4 * i + 0] / 255.0f;
+            g[l] = blocks[64 * l + 4 * i + 1] / 255.0f;
+            b[l] = blocks[64 * l + 4 * i + 2] / 255.0f;
+        }
 #endif
+    }
 }
 
-float compress_dxt1(const float input_colors[16 * 4], const float input_weights[16], const float rgb[3], bool three_color_mode, bool hq, void * output) {
-    return compress_dxt1((Vector4*)input_colors, input_weights, { rgb[0], rgb[1], rgb[2] }, three_color_mode, hq, (BlockDXT1*)output);
+// Load texel i from the output of load_blocks_soa. Loading from memory avoids copying VVector3 unions around in loops that are
+// not unrolled, which GCC does one 16 byte piece at a time.
+ICBC_FORCEINLINE VVector3 vload_texel(const float colors[16 * 3 * VEC_SIZE], int i)
+{
+    VVector3 c;
+    c.x = vload(colors + (3 * i + 0) * VEC_SIZE);
+    c.y = vload(colors + (3 * i + 1) * VEC_SIZE);
+    c.z = vload(colors + (3 * i + 2) * VEC_SIZE);
+    return c;
 }
 
-float compress_dxt1_fast(const float input_colors[16 * 4], const float input_weights[16], const float rgb[3], void * output) {
-    return compress_dxt1_fast((Vector4*)input_colors, input_weights, { rgb[0], rgb[1], rgb[2] }, (BlockDXT1*)output);
+// Bit expansion of 5 and 6 bit components, as in bitexpand_color16_to_color32.
+ICBC_FORCEINLINE VFloat vexpand5(VFloat q) { return q * vbroadcast(8.0f) + vtruncate(q * vbroadcast(0.25f)); }
+ICBC_FORCEINLINE VFloat vexpand6(VFloat q) { return q * vbroadcast(4.0f) + vtruncate(q * vbroadcast(1.0f / 16)); }
+
+// Look up table[q] in each lane.
+ICBC_FORCEINLINE VFloat vlookup(const float * table, VFloat q)
+{
+#if ICBC_USE_SPMD == ICBC_AVX2 || ICBC_USE_SPMD == ICBC_AVX512VL
+    return _mm256_i32gather_ps(table, _mm256_cvttps_epi32(q), 4);
+#elif ICBC_USE_SPMD == ICBC_AVX512
+    return _mm512_i32gather_ps(_mm512_cvttps_epi32(q), table, 4);
+#else
+    VFloat r = vzero();
+    for (int l = 0; l < VEC_SIZE; l++) {
+        lane(r, l) = table[int(lane(q, l))];
+    }
+    return r;
+#endif
 }
 
-void compress_dxt1_fast(const unsigned char input_colors[16 * 4], void * output) {
-    compress_dxt1_fast(input_colors, (BlockDXT1*)output);
+// Vector version of vector3_to_color16. Returns the 5:6:5 components without packing them.
+ICBC_FORCEINLINE VVector3 vquantize565(VVector3 v)
+{
+    const VFloat one = vbroadcast(1.0f);
+    const VFloat max5 = vbroadcast(31.0f);
+    const VFloat max6 = vbroadcast(63.0f);
+
+    // Truncate.
+    VVector3 q;
+    q.x = vtruncate(vmin(vmax(v.x * max5, vzero()), max5));
+    q.y = vtruncate(vmin(vmax(v.y * max6, vzero()), max6));
+    q.z = vtruncate(vmin(vmax(v.z * max5, vzero()), max5));
+
+    // Round exactly according to 565 bit-expansion.
+    q.x = vselect(v.x > vlookup(midpoints5, q.x), q.x, q.x + one);
+    q.y = vselect(v.y > vlookup(midpoints6, q.y), q.y, q.y + one);
+    q.z = vselect(v.z > vlookup(midpoints5, q.z), q.z, q.z + one);
+    return q;
 }
 
-void compress_dxt1_test(const float input_colors[16 * 4], const float input_weights[16], const float rgb[3], void * output) {
-    compress_dxt1_test((Vector4*)input_colors, input_weights, { rgb[0], rgb[1], rgb[2] }, (BlockDXT1*)output);
+ICBC_FORCEINLINE VFloat vpack565(VVector3 q)
+{
+    return q.x * vbroadcast(2048.0f) + q.y * vbroadcast(32.0f) + q.z;
 }
 
-float evaluate_dxt1_error(const unsigned char rgba_block[16 * 4], const void * dxt_block, Decoder decoder/*=Decoder_D3D10*/) {
-    return evaluate_dxt1_error(rgba_block, (BlockDXT1 *)dxt_block, decoder);
+// Vector version of evaluate_palette. Palette entries are in the [0, 255] range.
+ICBC_FORCEINLINE void vevaluate_palette(VVector3 q0, VVector3 q1, VFloat u0, VFloat u1, VVector3 palette[4])
+{
+#if ICBC_DECODER == Decoder_D3D10
+    palette[0] = { vexpand5(q0.x), vexpand6(q0.y), vexpand5(q0.z) };
+    palette[1] = { vexpand5(q1.x), vexpand6(q1.y), vexpand5(q1.z) };
+
+    const VFloat third = vbroadcast(1.0f / 3);
+    const VFloat half = vbroadcast(0.5f);
+    VVector3 p02 = palette[0] + palette[0] + palette[1];
+    VVector3 p12 = palette[1] + palette[1] + palette[0];
+    VVector3 p01 = palette[0] + palette[1];
+
+    VMask three_color_mode = u0 <= u1;
+    palette[2].x = vselect(three_color_mode, vtruncate(p02.x * third), vtruncate(p01.x * half));
+    palette[2].y = vselect(three_color_mode, vtruncate(p02.y * third), vtruncate(p01.y * half));
+    palette[2].z = vselect(three_color_mode, vtruncate(p02.z * third), vtruncate(p01.z * half));
+    palette[3].x = vselect(three_color_mode, vtruncate(p12.x * third), vzero());
+    palette[3].y = vselect(three_color_mode, vtruncate(p12.y * third), vzero());
+    palette[3].z = vselect(three_color_mode, vtruncate(p12.z * third), vzero());
+#else
+    // Other decoders use integer arithmetic that does not map to floats, evaluate them one lane at a time.
+    for (int l = 0; l < VEC_SIZE; l++) {
+        Color16 c0, c1;
+        c0.u = uint16(lane(u0, l));
+        c1.u = uint16(lane(u1, l));
+
+        Color32 palette32[4];
+        evaluate_palette(c0, c1, palette32);
+
+        for (int i = 0; i < 4; i++) {
+            lane(palette[i].x, l) = palette32[i].r;
+            lane(palette[i].y, l) = palette32[i].g;
+            lane(palette[i].z, l) = palette32[i].b;
+        }
+    }
+#endif
 }
 
-} // icbc
+struct VBlockDXT1 {
+    VFloat u0, u1;
+    VFloat indices_lo;  // Indices of texels 0-7.
+    VFloat indices_hi;  // Indices of texels 8-15.
+};
 
-// Do not polute preprocessor definitions.
-#undef ICBC_DECODER
-#undef ICBC_USE_SPMD
-#undef ICBC_ASSERT
+// Vector version of output_block4 followed by optimize_end_points4. The index selection and the least squares fit are fused in
+// the same loop, with the same operations as the scalar code, so that the results are bit identical unless the compiler fuses
+// multiply-adds differently in the two, or ICBC_USE_RCP is set. Returns the mask of the lanes with valid end points in a and b.
+ICBC_FORCEINLINE VMask voutput_block4(const float colors[16 * 3 * VEC_SIZE], VVector3 v0, VVector3 v1, VBlockDXT1 * block, VVector3 * a, VVector3 * b)
+{
+    VVector3 q0 = vquantize565(v0);
+    VVector3 q1 = vquantize565(v1);
+    VFloat u0 = vpack565(q0);
+    VFloat u1 = vpack565(q1);
+
+    VMask swap_mask = u0 < u1;
+    VVector3 tq = q0;
+    q0 = vselect(swap_mask, q0, q1);
+    q1 = vselect(swap_mask, q1, tq);
+    VFloat tu = u0;
+    u0 = vselect(swap_mask, u0, u1);
+    u1 = vselect(swap_mask, u1, tu);
+
+    VVector3 palette[4];
+    vevaluate_palette(q0, q1, u0, u1, palette);
+
+    const VFloat one = vbroadcast(1.0f);
+    const VFloat two_thirds = vbroadcast(2.0f / 3);
+    const VFloat one_third = vbroadcast(1.0f / 3);
+
+    VFloat indices_lo = vzero();
+    VFloat indices_hi = vzero();
+
+    VFloat alpha2_sum = vzero();
+    VFloat beta2_sum = vzero();
+    VFloat alphabeta_sum = vzero();
+    VVector3 alphax_sum = { vzero(), vzero(), vzero() };
+    VVector3 betax_sum = { vzero(), vzero(), vzero() };
+
+    for (int i = 0; i < 16; i++) {
+        VVector3 c = vload_texel(colors, i);
+
+        // Indices are selected in the [0, 255] range like in compute_indices4. Scaling back the colors gives the original
+        // integers, and so does scaling the palette after color_to_vector3, so the integer palette is used directly. The colors
+        // are rounded so that the scaling is not fused with the subtraction, which would keep the error of the division.
+        const VFloat scale = vbroadcast(255.0f);
+        VVector3 x = { vround(c.x * scale), vround(c.y * scale), vround(c.z * scale) };
+        VVector3 t0 = x - palette[0];
+        VVector3 t1 = x - palette[1];
+        VVector3 t2 = x - palette[2];
+        VVector3 t3 = x - palette[3];
+        VFloat d0 = vdot(t0, t0);
+        VFloat d1 = vdot(t1, t1);
+        VFloat d2 = vdot(t2, t2);
+        VFloat d3 = vdot(t3, t3);
+
+        VMask b0 = d0 > d3;
+        VMask b1 = d1 > d2;
+        VMask b2 = d0 > d2;
+        VMask b3 = d1 > d3;
+        VMask b4 = d2 > d3;
+
+        VMask lsb = b0 & b4;
+        VMask msb = (b1 & b2) | (b0 & b3);
+
+        // Indices are accumulated as floats, 16 bits fit exactly in the mantissa.
+        const float bit = float(1 << (2 * (i & 7)));
+        VFloat index = vselect(lsb, vzero(), vbroadcast(bit)) + vselect(msb, vzero(), vbroadcast(2 * bit));
+        if (i < 8) indices_lo = indices_lo + index;
+        else indices_hi = indices_hi + index;
+
+        // factors = { 1, 0, 2/3, 1/3 }
+        VFloat alpha = vselect(msb, vselect(lsb, one, vzero()), vselect(lsb, two_thirds, one_third));
+        VFloat beta = one - alpha;
+
+        // Same operations as optimize_end_points4 rather than vmad, which is always fused on AVX-512.
+        alpha2_sum = alpha2_sum + alpha * alpha;
+        beta2_sum = beta2_sum + beta * beta;
+        alphabeta_sum = alphabeta_sum + alpha * beta;
+        alphax_sum = alphax_sum + c * alpha;
+        betax_sum = betax_sum + c * beta;
+    }
+
+    block->u0 = u0;
+    block->u1 = u1;
+    block->indices_lo = indices_lo;
+    block->indices_hi = indices_hi;
+
+    VFloat denom = alpha2_sum * beta2_sum - alphabeta_sum * alphabeta_sum;
+    VFloat factor = vrcp(denom);
+
+    *a = vsaturate((alphax_sum * beta2_sum - betax_sum * alphabeta_sum) * factor);
+    *b = vsaturate((betax_sum * alpha2_sum - alphax_sum * alphabeta_sum) * factor);
+
+    // Same threshold as equal(denom, 0.0f).
+    const VFloat epsilon = vbroadcast(0.0001f);
+    return (denom >= epsilon) | (denom <= vzero() - epsilon);
+}
+
+// Vector version of compress_dxt1_fast. Compresses the first count blocks, lanes beyond that are ignored.
+static void compress_dxt1_fast_batch(const uint8 * input_blocks, int count, BlockDXT1 * output)
+{
+    // Skip the vector path when all the blocks are solid.
+    int single_color_count = 0;
+    for (int l = 0; l < count; l++) {
+        single_color_count += is_single_color_rgba8(input_blocks + 64 * l);
+    }
+    if (single_color_count == count) {
+        for (int l = 0; l < count; l++) {
+            compress_dxt1_single_color_optimal(*(const Color8 *)(input_blocks + 64 * l), output + l);
+        }
+        return;
+    }
+
+    ICBC_ALIGN_64 float colors[16 * 3 * VEC_SIZE];
+    load_blocks_soa(input_blocks, colors);
+
+    // Quick end point selection.
+    VVector3 c0 = vload_texel(colors, 0);
+    VVector3 c1 = c0;
+    for (int i = 1; i < 16; i++) {
+        VVector3 c = vload_texel(colors, i);
+        c0 = vmax(c0, c);
+        c1 = vmin(c1, c);
+    }
+
+    VMask single_color = (c0.x <= c1.x) & (c0.y <= c1.y) & (c0.z <= c1.z);
+
+    // inset_bbox
+    const VFloat bias = vbroadcast((8.0f / 255.0f) / 16.0f);
+    const VFloat inv16 = vbroadcast(1.0f / 16);
+    VVector3 inset = { (c0.x - c1.x) * inv16 - bias, (c0.y - c1.y) * inv16 - bias, (c0.z - c1.z) * inv16 - bias };
+    c0 = vsaturate(c0 - inset);
+    c1 = vsaturate(c1 + inset);
+
+    // select_diagonal
+    VVector3 center = (c0 + c1) * vbroadcast(0.5f);
+    VFloat cov_xz = vzero();
+    VFloat cov_yz = vzero();
+    for (int i = 0; i < 16; i++) {
+        VVector3 t = vload_texel(colors, i) - center;
+        cov_xz = cov_xz + t.x * t.z;
+        cov_yz = cov_yz + t.y * t.z;
+    }
+
+    VMask swap_x = cov_xz < vzero();
+    VMask swap_y = cov_yz < vzero();
+    VFloat x0 = vselect(swap_x, c0.x, c1.x);
+    VFloat x1 = vselect(swap_x, c1.x, c0.x);
+    VFloat y0 = vselect(swap_y, c0.y, c1.y);
+    VFloat y1 = vselect(swap_y, c1.y, c0.y);
+
+    c0 = { x0, y0, c0.z };
+    c1 = { x1, y1, c1.z };
+
+    VBlockDXT1 block;
+    VVector3 a, b;
+    VMask lsq_mask = voutput_block4(colors, c0, c1, &block, &a, &b);
+
+    // Refine color for the selected indices.
+    if (any(lsq_mask)) {
+        VBlockDXT1 refined_block;
+        voutput_block4(colors, vselect(lsq_mask, c0, a), vselect(lsq_mask, c1, b), &refined_block, &a, &b);
+
+        block.u0 = vselect(lsq_mask, block.u0, refined_block.u0);
+        block.u1 = vselect(lsq_mask, block.u1, refined_block.u1);
+        block.indices_lo = vselect(lsq_mask, block.indices_lo, refined_block.indices_lo);
+        block.indices_hi = vselect(lsq_mask, block.indices_hi, refined_block.indices_hi);
+    }
+
+    VFloat single = vselect(single_color, vzero(), vbroadcast(1.0f));
+
+    for (int l = 0; l < count; l++) {
+        if (lane(single, l) != 0) {
+            compress_dxt1_single_color_optimal(*(const Color8 *)(input_blocks + 64 * l), output + l);
+        }
+        else {
+            output[l].col0.u = uint16(lane(block.u0, l));
+            output[l].col1.u = uint16(lane(block.u1, l));
+            output[l].indices = uint(lane(block.indices_lo, l)) | (uint(lane(block.indices_hi, l)) << 16);
+        }
+    }
+}
+
+static void compress_dxt1_fast_blocks(int block_count, const uint8 * input_blocks, BlockDXT1 * output)
+{
+    int i = 0;
+    for (; i + VEC_SIZE <= block_count; i += VEC_SIZE) {
+        compress_dxt1_fast_batch(input_blocks + 64 * i, VEC_SIZE, output + i);
+    }
+
+    if (i < block_count) {
+        // Pad the last batch by replicating the last block.
+        ICBC_ALIGN_64 uint8 tail[64 * VEC_SIZE];
+        for (int l = 0; l < VEC_SIZE; l++) {
+            memcpy(tail + 64 * l, input_blocks + 64 * min(i + l, block_count - 1), 64);
+        }
+        compress_dxt1_fast_batch(tail, block_count - i, output + i);
+    }
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// BC4 and BC5 compression.
+
+// Values are approximated by the steps + 1 evenly spaced levels of the [lo, hi] interval. With 7 steps alpha0 = hi and alpha1 = lo,
+// with 5 steps alpha0 = lo and alpha1 = hi, and the values can also map to 0 and 255. These tables map the level to the index.
+// Decoders that output 8 bits round the interpolated levels to the nearest integer. Since lo + t * (hi - lo) / steps is never
+// halfway between two integers, the level closest to a value is also the closest once rounded, but the errors are evaluated with
+// the rounded levels, so that they match the decoded block.
+static const uint8 s_bc4_indices7[8] = { 1, 7, 6, 5, 4, 3, 2, 0 };
+static const uint8 s_bc4_indices5[6] = { 0, 2, 3, 4, 5, 1 };
+
+inline int bc4_level(int lo, int hi, int t, int steps) {
+    return (lo * (steps - t) + hi * t + steps / 2) / steps;
+}
+
+// Error of the [lo, hi] intervals of each lane.
+ICBC_FORCEINLINE VFloat vevaluate_bc4(const float values[16], VFloat lo, VFloat hi, int steps)
+{
+    const VFloat vsteps = vbroadcast(float(steps));
+    const VFloat range = hi - lo;
+    const VFloat inv_range = vrcp(vmax(range, vbroadcast(1.0f)));
+    const VFloat step = range * vbroadcast(1.0f / steps);
+    const VFloat max255 = vbroadcast(255.0f);
+
+    VFloat error = vzero();
+    for (int i = 0; i < 16; i++) {
+        VFloat v = vbroadcast(values[i]);
+        VFloat t = vround(vsaturate((v - lo) * inv_range) * vsteps);
+        VFloat d = v - vround(vmad(t, step, lo));
+        VFloat e = d * d;
+        if (steps == 5) {
+            e = vmin(e, vmin(v * v, (max255 - v) * (max255 - v)));
+        }
+        error = error + e;
+    }
+    return error;
+}
+
+// Returns the level of the [lo, hi] interval closest to v, or -1 and -2 for 0 and 255.
+static int select_bc4_level(float v, int lo, int hi, int steps, float * error)
+{
+    const float inv_range = (hi > lo) ? 1.0f / (hi - lo) : 0.0f;
+    int t = int(saturate((v - lo) * inv_range) * steps + 0.5f);
+    float d = v - float(bc4_level(lo, hi, t, steps));
+    *error = d * d;
+    if (steps == 5) {
+        if (v * v < *error) { *error = v * v; t = -1; }
+        if ((255 - v) * (255 - v) < *error) { *error = (255 - v) * (255 - v); t = -2; }
+    }
+    return t;
+}
+
+static float output_block_bc4(const float values[16], int lo, int hi, int steps, BlockBC4 * output)
+{
+    uint64 indices = 0;
+    float total_error = 0;
+    for (int i = 0; i < 16; i++) {
+        float error;
+        int t = select_bc4_level(values[i], lo, hi, steps, &error);
+        uint64 index = (t == -1) ? 6 : (t == -2) ? 7 : (steps == 7) ? s_bc4_indices7[t] : s_bc4_indices5[t];
+        indices |= index << (3 * i);
+        total_error += error;
+    }
+
+    output->alpha0 = uint8(steps == 7 ? hi : lo);
+    output->alpha1 = uint8(steps == 7 ? lo : hi);
+    for (int i = 0; i < 6; i++) {
+        output->indices[i] = uint8(indices >> (8 * i));
+    }
+    return total_error;
+}
+
+// Least squares fit of the interval end points for the levels selected with [lo, hi]. Values mapped to 0 or 255 are ignored.
+static bool optimize_end_points_bc4(const float values[16], int lo, int hi, int steps, int * new_lo, int * new_hi)
+{
+    float alpha2_sum = 0, beta2_sum = 0, alphabeta_sum = 0, alphax_sum = 0, betax_sum = 0;
+    for (int i = 0; i < 16; i++) {
+        float error;
+        int t = select_bc4_level(values[i], lo, hi, steps, &error);
+        if (t < 0) continue;
+
+        float beta = float(t) / steps;
+        float alpha = 1.0f - beta;
+        alpha2_sum += alpha * alpha;
+        beta2_sum += beta * beta;
+        alphabeta_sum += alpha * beta;
+        alphax_sum += alpha * values[i];
+        betax_sum += beta * values[i];
+    }
+
+    float denom = alpha2_sum * beta2_sum - alphabeta_sum * alphabeta_sum;
+    if (equal(denom, 0.0f)) return false;
+
+    float factor = 1.0f / denom;
+    float a = (alphax_sum * beta2_sum - betax_sum * alphabeta_sum) * factor;
+    float b = (betax_sum * alpha2_sum - alphax_sum * alphabeta_sum) * factor;
+
+    *new_lo = clamp(int(a + 0.5f), 0, 255);
+    *new_hi = clamp(int(b + 0.5f), *new_lo, 255);
+    return true;
+}
+
+// The values are the 8 bit inputs converted to float.
+static float compress_bc4(const float values[16], BlockBC4 * output)
+{
+    int min7 = 255, max7 = 0;
+    int min5 = 255, max5 = 0;
+    for (int i = 0; i < 16; i++) {
+        int v = int(values[i]);
+        min7 = min(min7, v);
+        max7 = max(max7, v);
+        if (v != 0 && v != 255) {
+            min5 = min(min5, v);
+            max5 = max(max5, v);
+        }
+    }
+
+    if (min7 == max7) {
+        return output_block_bc4(values, min7, min7, 5, output);
+    }
+    if (min5 > max5) {
+        min5 = max5 = 0;
+    }
+
+    // Evaluate the intervals of the bounds inset by up to 3/24 of the range, with 7 steps in the first half of the candidates and
+    // with 5 steps in the second half.
+    ICBC_ALIGN_64 float candidate_lo[32];
+    ICBC_ALIGN_64 float candidate_hi[32];
+    const int inset7 = max(1, (max7 - min7) / 24);
+    const int inset5 = max(1, (max5 - min5) / 24);
+    for (int i = 0; i < 16; i++) {
+        int lo7 = min(min7 + (i & 3) * inset7, max7);
+        int lo5 = min(min5 + (i & 3) * inset5, max5);
+        candidate_lo[i] = float(lo7);
+        candidate_hi[i] = float(max(max7 - (i >> 2) * inset7, lo7));
+        candidate_lo[16 + i] = float(lo5);
+        candidate_hi[16 + i] = float(max(max5 - (i >> 2) * inset5, lo5));
+    }
+
+    int best = 0;
+    float best_error = FLT_MAX;
+    for (int i = 0; i < 32; i += VEC_SIZE) {
+        VFloat error = vevaluate_bc4(values, vload(candidate_lo + i), vload(candidate_hi + i), i < 16 ? 7 : 5);
+        for (int l = 0; l < VEC_SIZE; l++) {
+            if (lane(error, l) < best_error) {
+                best_error = lane(error, l);
+                best = i + l;
+            }
+        }
+    }
+
+    int lo = int(candidate_lo[best]);
+    int hi = int(candidate_hi[best]);
+    const int steps = best < 16 ? 7 : 5;
+    best_error = output_block_bc4(values, lo, hi, steps, output);
+
+    for (int i = 0; i < 4; i++) {
+        int new_lo, new_hi;
+        if (!optimize_end_points_bc4(values, lo, hi, steps, &new_lo, &new_hi) || (new_lo == lo && new_hi == hi)) break;
+
+        BlockBC4 refined;
+        float refined_error = output_block_bc4(values, new_lo, new_hi, steps, &refined);
+        if (refined_error >= best_error) break;
+
+        best_error = refined_error;
+        *output = refined;
+        lo = new_lo;
+        hi = new_hi;
+    }
+
+    return best_error;
+}
+
+static float compress_bc4(const uint8 input_values[16], BlockBC4 * output)
+{
+    ICBC_ALIGN_64 float values[16];
+    for (int i = 0; i < 16; i++) {
+        values[i] = float(input_values[i]);
+    }
+    return compress_bc4(values, output);
+}
+
+static float compress_bc5(const uint8 input_colors[16 * 4], BlockBC4 output[2])
+{
+    uint8 r[16], g[16];
+    for (int i = 0; i < 16; i++) {
+        r[i] = input_colors[4 * i + 0];
+        g[i] = input_colors[4 * i + 1];
+    }
+    return compress_bc4(r, output + 0) + compress_bc4(g, output + 1);
+}
+
+// The texels are transposed once, the color channels into the block shared by the color error evaluations and the alpha channel
+// into the values of the BC4 encoder.
+static void load_block_colors(const Color8 input_colors[16], const Vector3 & color_weights, BlockColors * block, float alpha[16]) {
+    for (int i = 0; i < 16; i++) {
+        Color8 c = input_colors[i];
+        block->colors[i + 0] = float(c.r) * color_weights.x;
+        block->colors[i + 16] = float(c.g) * color_weights.y;
+        block->colors[i + 32] = float(c.b) * color_weights.z;
+        block->weights[i] = 1.0f;
+        alpha[i] = float(c.a);
+    }
+    block->color_weights = color_weights;
+}
+
+// The color block of BC3 is always decoded with 4 colors, so the 3 color mode is disabled.
+static float compress_bc3(const Color8 input_colors[16], Vector3 color_weights, Quality quality, float max_error, BlockBC3 * output)
+{
+    BlockColors block;
+    ICBC_ALIGN_64 float alpha[16];
+    load_block_colors(input_colors, color_weights, &block, alpha);
+
+    float alpha_error = compress_bc4(alpha, &output->alpha);
+
+    float color_error;
+    if (!compress_dxt1_solid(input_colors, color_weights, &output->color, &color_error)) {
+        color_error = compress_dxt1(input_colors, s_unit_weights, block, color_weights, /*three_color_mode=*/false, quality, max_error, &output->color);
+    }
+    return color_error + alpha_error;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// Image compression.
+
+// Copy a 4x4 block from the source rows, replicating the last column and row when the block is partially outside the image.
+static void load_block_rgba8(const uint8 * rgba8, int width, int height, int row_stride, int x, int y, uint8 output[16 * 4])
+{
+    if (x + 4 <= width && y + 4 <= height) {
+        for (int yy = 0; yy < 4; yy++) {
+            memcpy(output + 16 * yy, rgba8 + size_t(y + yy) * row_stride + 4 * x, 16);
+        }
+    }
+    else {
+        for (int yy = 0; yy < 4; yy++) {
+            const uint8 * row = rgba8 + size_t(min(y + yy, height - 1)) * row_stride;
+            for (int xx = 0; xx < 4; xx++) {
+                memcpy(output + 16 * yy + 4 * xx, row + 4 * min(x + xx, width - 1), 4);
+            }
+        }
+    }
+}
+
+struct ImageContext {
+    const uint8 * rgba8;
+    int width;
+    int height;
+    int row_stride;
+    int block_width;
+    Vector3 color_weights;
+    bool three_color_mode;
+    Quality quality;
+    float max_error;
+    BlockDXT1 * output;
+
+    // Block cache, only used by compress_dxt1_image.
+    int * block_table;          // Open addressing hash table of the indices of the unique blocks, -1 if empty.
+    uint table_mask;
+    int * unique_blocks;        // Index of the first block with the same texels, as found in block_table.
+};
+
+static void compress_dxt1_image_block(void * context, int b)
+{
+    const ImageContext * ctx = (const ImageContext *)context;
+    const int x = 4 * (b % ctx->block_width);
+    const int y = 4 * (b / ctx->block_width);
+
+    Color8 input_colors[16];
+    load_block_rgba8(ctx->rgba8, ctx->width, ctx->height, ctx->row_stride, x, y, (uint8 *)input_colors);
+
+    compress_dxt1(input_colors, ctx->color_weights, ctx->three_color_mode, ctx->quality, ctx->max_error, ctx->output + b);
+}
+
+// Returns the original value, value is only replaced when it was equal to comparand.
+inline int atomic_compare_exchange(int * value, int comparand, int new_value) {
+#if __GNUC__
+    return __sync_val_compare_and_swap(value, comparand, new_value);
+#else // _MSC_VER
+    return int(_InterlockedCompareExchange((long *)value, (long)new_value, (long)comparand));
+#endif
+}
+
+// FNV-1a of the 32 bit words of the block.
+static uint hash_block(const uint8 input_colors[16 * 4])
+{
+    uint hash = 2166136261u;
+    for (int i = 0; i < 16; i++) {
+        uint word;
+        memcpy(&word, input_colors + 4 * i, 4);
+        hash = (hash ^ word) * 16777619u;
+    }
+    return hash ^ (hash >> 15);
+}
+
+// Insert block b in the hash table unless there's already a block with the same texels. Slots are claimed with a compare and
+// exchange, so blocks can be inserted from multiple threads. All the settings are the same during an image, so only the texels
+// need to be compared.
+static void find_unique_block(void * context, int b)
+{
+    const ImageContext * ctx = (const ImageContext *)context;
+
+    uint8 input_colors[16 * 4];
+    load_block_rgba8(ctx->rgba8, ctx->width, ctx->height, ctx->row_stride, 4 * (b % ctx->block_width), 4 * (b / ctx->block_width), input_colors);
+
+    uint slot = hash_block(input_colors) & ctx->table_mask;
+    for (;;) {
+        int other = atomic_compare_exchange(ctx->block_table + slot, -1, b);
+        if (other == -1) {
+            ctx->unique_blocks[b] = b;
+            return;
+        }
+
+        uint8 other_colors[16 * 4];
+        load_block_rgba8(ctx->rgba8, ctx->width, ctx->height, ctx->row_stride, 4 * (other % ctx->block_width), 4 * (other / ctx->block_width), other_colors);
+        if (memcmp(input_colors, other_colors, 16 * 4) == 0) {
+            ctx->unique_blocks[b] = other;
+            return;
+        }
+
+        slot = (slot + 1) & ctx->table_mask;
+    }
+}
+
+static void compress_dxt1_unique_image_block(void * context, int b)
+{
+    const ImageContext * ctx = (const ImageContext *)context;
+    if (ctx->unique_blocks[b] == b) {
+        compress_dxt1_image_block(context, b);
+    }
+}
+
+static void init_image_context(ImageContext * ctx, int width, int height, int row_stride, const uint8 * rgba8, const Options & options, BlockDXT1 * output)
+{
+    ctx->rgba8 = rgba8;
+    ctx->width = width;
+    ctx->height = height;
+    ctx->row_stride = row_stride;
+    ctx->block_width = (width + 3) / 4;
+    ctx->color_weights = { options.color_weights[0], options.color_weights[1], options.color_weights[2] };
+    ctx->three_color_mode = options.three_color_mode;
+    ctx->quality = options.quality;
+    ctx->max_error = options.max_error;
+    ctx->output = output;
+    ctx->block_table = nullptr;
+    ctx->table_mask = 0;
+    ctx->unique_blocks = nullptr;
+}
+
+static void compress_dxt1_image(int width, int height, int row_stride, const uint8 * rgba8, const Options & options, BlockDXT1 * output)
+{
+    if (width <= 0 || height <= 0) return;
+
+    ImageContext ctx;
+    init_image_context(&ctx, width, height, row_stride, rgba8, options, output);
+
+    const int block_count = ctx.block_width * ((height + 3) / 4);
+
+    if (options.block_cache) {
+        // Table with at least twice as many slots as blocks.
+        uint table_size = 1;
+        while (table_size < 2 * uint(block_count)) table_size *= 2;
+
+        ctx.block_table = (int *)malloc(sizeof(int) * table_size);
+        ctx.table_mask = table_size - 1;
+        ctx.unique_blocks = (int *)malloc(sizeof(int) * block_count);
+
+        // If the cache can't be allocated, compress every block instead.
+        const bool cached = ctx.block_table != nullptr && ctx.unique_blocks != nullptr;
+        if (cached) {
+            memset(ctx.block_table, 0xFF, sizeof(int) * table_size);
+
+#if ICBC_USE_PFOR
+            ic::pfor_run(find_unique_block, &ctx, block_count, 64);
+            ic::pfor_run(compress_dxt1_unique_image_block, &ctx, block_count, 32);
+#else
+            for (int b = 0; b < block_count; b++) {
+                find_unique_block(&ctx, b);
+            }
+            for (int b = 0; b < block_count; b++) {
+                compress_dxt1_unique_image_block(&ctx, b);
+            }
+#endif
+
+            for (int b = 0; b < block_count; b++) {
+                output[b] = output[ctx.unique_blocks[b]];
+            }
+        }
+
+        free(ctx.block_table);
+        free(ctx.unique_blocks);
+        if (cached) return;
+    }
+
+#if ICBC_USE_PFOR
+    ic::pfor_run(compress_dxt1_image_block, &ctx, block_count, 32);
+#else
+    for (int b = 0; b < block_count; b++) {
+        compress_dxt1_image_block(&ctx, b);
+    }
+#endif
+}
+
+struct BC4ImageContext {
+    const uint8 * rgba8;
+    int width;
+    int height;
+    int row_stride;
+    int block_width;
+    int channel_count;      // 1 for BC4, 2 for BC5.
+    BlockBC4 * output;
+};
+
+static void compress_bc4_image_block(void * context, int b)
+{
+    const BC4ImageContext * ctx = (const BC4ImageContext *)context;
+    const int x = 4 * (b % ctx->block_width);
+    const int y = 4 * (b / ctx->block_width);
+
+    uint8 input_colors[16 * 4];
+    load_block_rgba8(ctx->rgba8, ctx->width, ctx->height, ctx->row_stride, x, y, input_colors);
+
+    if (ctx->channel_count == 1) {
+        uint8 r[16];
+        for (int i = 0; i < 16; i++) r[i] = input_colors[4 * i];
+        compress_bc4(r, ctx->output + b);
+    }
+    else {
+        compress_bc5(input_colors, ctx->output + 2 * b);
+    }
+}
+
+static void compress_bc4_image(int width, int height, int row_stride, const uint8 * rgba8, int channel_count, BlockBC4 * output)
+{
+    if (width <= 0 || height <= 0) return;
+
+    BC4ImageContext ctx;
+    ctx.rgba8 = rgba8;
+    ctx.width = width;
+    ctx.height = height;
+    ctx.row_stride = row_stride;
+    ctx.block_width = (width + 3) / 4;
+    ctx.channel_count = channel_count;
+    ctx.output = output;
+
+    const int block_count = ctx.block_width * ((height + 3) / 4);
+
+#if ICBC_USE_PFOR
+    ic::pfor_run(compress_bc4_image_block, &ctx, block_count, 32);
+#else
+    for (int b = 0; b < block_count; b++) {
+        compress_bc4_image_block(&ctx, b);
+    }
+#endif
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// Mipmap compression.
+
+// Rows of the destination level generated and compressed at once. 16 rows of a 2048 wide level are downsampled from 32 rows of the
+// 4096 wide source, 512 KB of texels.
+#define ICBC_MIPMAP_STRIP_HEIGHT 16
+
+// 2x2 box filter of the source rows [2*y0, 2*y1). Odd sizes replicate the last column and row.
+static void downsample_rgba8(const uint8 * src, int src_width, int src_height, int src_row_stride, uint8 * dst, int dst_width, int y0, int y1)
+{
+    for (int y = y0; y < y1; y++) {
+        const uint8 * row0 = src + size_t(min(2 * y, src_height - 1)) * src_row_stride;
+        const uint8 * row1 = src + size_t(min(2 * y + 1, src_height - 1)) * src_row_stride;
+        uint8 * out = dst + size_t(y) * dst_width * 4;
+
+        for (int x = 0; x < dst_width; x++) {
+            const int x0 = 4 * min(2 * x, src_width - 1);
+            const int x1 = 4 * min(2 * x + 1, src_width - 1);
+            for (int c = 0; c < 4; c++) {
+                out[4 * x + c] = uint8((row0[x0 + c] + row0[x1 + c] + row1[x0 + c] + row1[x1 + c] + 2) >> 2);
+            }
+        }
+    }
+}
+
+static void compress_dxt1_image_rows(const ImageContext * ctx, int block_row_begin, int block_row_end)
+{
+    block_row_end = min(block_row_end, (ctx->height + 3) / 4);
+    for (int b = block_row_begin * ctx->block_width; b < block_row_end * ctx->block_width; b++) {
+        compress_dxt1_image_block((void *)ctx, b);
+    }
+}
+
+struct MipmapContext {
+    ImageContext src;       // Level being downsampled.
+    ImageContext dst;       // Level being generated, dst.rgba8 points to pixels.
+    uint8 * pixels;
+    bool compress_src;      // Only the first level is compressed together with its source.
+};
+
+static void compress_dxt1_mipmap_strip(void * context, int s)
+{
+    const MipmapContext * ctx = (const MipmapContext *)context;
+    const int strip_block_rows = ICBC_MIPMAP_STRIP_HEIGHT / 4;
+
+    // The source rows of the strip are compressed first, so that they are in the cache when downsampled.
+    if (ctx->compress_src) {
+        compress_dxt1_image_rows(&ctx->src, 2 * strip_block_rows * s, 2 * strip_block_rows * (s + 1));
+    }
+
+    const int y0 = ICBC_MIPMAP_STRIP_HEIGHT * s;
+    const int y1 = min(y0 + ICBC_MIPMAP_STRIP_HEIGHT, ctx->dst.height);
+    if (y0 < y1) {
+        downsample_rgba8(ctx->src.rgba8, ctx->src.width, ctx->src.height, ctx->src.row_stride, ctx->pixels, ctx->dst.width, y0, y1);
+        compress_dxt1_image_rows(&ctx->dst, strip_block_rows * s, strip_block_rows * (s + 1));
+    }
+}
+
+static bool compress_dxt1_mipmaps(int width, int height, int row_stride, const uint8 * rgba8, const Options & options, BlockDXT1 * output)
+{
+    if (width <= 0 || height <= 0) return true;
+
+    if (width == 1 && height == 1) {
+        compress_dxt1_image(width, height, row_stride, rgba8, options, output);
+        return true;
+    }
+
+    // Odd and even levels alternate between two buffers, sized for the two largest levels.
+    const int w1 = max(1, width / 2), h1 = max(1, height / 2);
+    const int w2 = max(1, w1 / 2), h2 = max(1, h1 / 2);
+    uint8 * buffers[2];
+    buffers[0] = (uint8 *)malloc(size_t(w1) * h1 * 4);
+    buffers[1] = (uint8 *)malloc(size_t(w2) * h2 * 4);
+    if (buffers[0] == nullptr || buffers[1] == nullptr) {
+        free(buffers[0]);
+        free(buffers[1]);
+        return false;
+    }
+
+    MipmapContext ctx;
+    init_image_context(&ctx.src, width, height, row_stride, rgba8, options, output);
+    ctx.compress_src = true;
+
+    for (int level = 1; ; level++) {
+        const int w = max(1, ctx.src.width / 2);
+        const int h = max(1, ctx.src.height / 2);
+        BlockDXT1 * level_output = ctx.src.output + ctx.src.block_width * ((ctx.src.height + 3) / 4);
+
+        ctx.pixels = buffers[(level - 1) & 1];
+        init_image_context(&ctx.dst, w, h, w * 4, ctx.pixels, options, level_output);
+
+        int strip_count = (h + ICBC_MIPMAP_STRIP_HEIGHT - 1) / ICBC_MIPMAP_STRIP_HEIGHT;
+        if (ctx.compress_src) {
+            strip_count = max(strip_count, (ctx.src.height + 2 * ICBC_MIPMAP_STRIP_HEIGHT - 1) / (2 * ICBC_MIPMAP_STRIP_HEIGHT));
+        }
+
+#if ICBC_USE_PFOR
+        ic::pfor_run(compress_dxt1_mipmap_strip, &ctx, strip_count, 1);
+#else
+        for (int s = 0; s < strip_count; s++) {
+            compress_dxt1_mipmap_strip(&ctx, s);
+        }
+#endif
+
+        if (w == 1 && h == 1) break;
+
+        ctx.src = ctx.dst;
+        ctx.compress_src = false;
+    }
+
+    free(buffers[0]);
+    free(buffers[1]);
+    return true;
+}
+
+// Entry points of this instruction set, called from the public API.
+
+void init_dxt1() {
+    init_dxt1_tables();
+    init_cluster_tables();
+#if ICBC_FAST_CLUSTER_FIT
+    init_lsqr_tables();
+#endif
+#if ICBC_CLUSTER_FIT_PRUNING
+    init_cluster_bounds();
+#endif
+#if ICBC_USE_AVX2_GATHER
+    select_sat_lookup();
+#endif
+}
+
+float compress_dxt1(const float input_colors[16 * 4], const float input_weights[16], const float rgb[3], bool three_color_mode, bool hq, void * output) {
+    return compress_dxt1((Vector4*)input_colors, input_weights, { rgb[0], rgb[1], rgb[2] }, three_color_mode, hq ? Quality_Max : Quality_Default, 0.0f, (BlockDXT1*)output);
+}
+
+float compress_dxt1(const unsigned char input_colors[16 * 4], const Options & options, void * output) {
+    const float * rgb = options.color_weights;
+    return compress_dxt1((const Color8 *)input_colors, { rgb[0], rgb[1], rgb[2] }, options.three_color_mode, options.quality, options.max_error, (BlockDXT1*)output);
+}
+
+float compress_dxt1_fast(const float input_colors[16 * 4], const float input_weights[16], const float rgb[3], void * output) {
+    return compress_dxt1_fast((Vector4*)input_colors, input_weights, { rgb[0], rgb[1], rgb[2] }, (BlockDXT1*)output);
+}
+
+void compress_dxt1_fast(const unsigned char input_colors[16 * 4], void * output) {
+    compress_dxt1_fast(input_colors, (BlockDXT1*)output);
+}
+
+void compress_dxt1_fast_blocks(int block_count, const unsigned char * input_blocks, void * output) {
+    compress_dxt1_fast_blocks(block_count, input_blocks, (BlockDXT1*)output);
+}
+
+void compress_dxt1_test(const float input_colors[16 * 4], const float input_weights[16], const float rgb[3], void * output) {
+    compress_dxt1_test((Vector4*)input_colors, input_weights, { rgb[0], rgb[1], rgb[2] }, (BlockDXT1*)output);
+}
+
+void compress_dxt1_image(int width, int height, int row_stride, const unsigned char * rgba8, const Options & options, void * output) {
+    compress_dxt1_image(width, height, row_stride, rgba8, options, (BlockDXT1*)output);
+}
+
+bool compress_dxt1_mipmaps(int width, int height, int row_stride, const unsigned char * rgba8, const Options & options, void * output) {
+    return compress_dxt1_mipmaps(width, height, row_stride, rgba8, options, (BlockDXT1*)output);
+}
+
+float compress_bc4(const unsigned char input_values[16], void * output) {
+    return compress_bc4(input_values, (BlockBC4*)output);
+}
+
+float compress_bc5(const unsigned char input_colors[16 * 4], void * output) {
+    return compress_bc5(input_colors, (BlockBC4*)output);
+}
+
+float compress_bc3(const unsigned char input_colors[16 * 4], const Options & options, void * output) {
+    const float * rgb = options.color_weights;
+    return compress_bc3((const Color8 *)input_colors, { rgb[0], rgb[1], rgb[2] }, options.quality, options.max_error, (BlockBC3*)output);
+}
+
+void compress_bc4_image(int width, int height, int row_stride, const unsigned char * rgba8, void * output) {
+    compress_bc4_image(width, height, row_stride, rgba8, 1, (BlockBC4*)output);
+}
+
+void compress_bc5_image(int width, int height, int row_stride, const unsigned char * rgba8, void * output) {
+    compress_bc4_image(width, height, row_stride, rgba8, 2, (BlockBC4*)output);
+}
+
+float evaluate_dxt1_error(const unsigned char rgba_block[16 * 4], const void * dxt_block, Decoder decoder/*=Decoder_D3D10*/) {
+    return evaluate_dxt1_error(rgba_block, (BlockDXT1 *)dxt_block, decoder);
+}
+
+} // ICBC_NAMESPACE
+} // icbc
+
+#undef VEC_SIZE
+#undef ICBC_USE_AVX2_PERMUTE2
+#undef ICBC_USE_AVX2_PERMUTE
+#undef ICBC_USE_AVX2_GATHER
+#undef ICBC_USE_AVX512_PERMUTE
+#undef ICBC_USE_AVX512VL_PERMUTE
+#undef ICBC_USE_SSE41_SHUFFLE
+#undef ICBC_CLUSTER_FIT_PRUNING
+#undef ICBC_MIPMAP_STRIP_HEIGHT
+
+#else // ICBC_IMPLEMENTATION_ISA
+
+// Compile the code above for each instruction set. Quoted includes are searched relative to this file first, unlike __FILE__,
+// which already contains the include path. Define ICBC_SELF_INCLUDE when the header is renamed.
+#ifndef ICBC_SELF_INCLUDE
+#define ICBC_SELF_INCLUDE "icbc.h"
+#endif
+
+#if ICBC_DISPATCH
+
+#define ICBC_STRINGIZE(x) #x
+#if __clang__
+#define ICBC_TARGET_BEGIN(t) _Pragma(ICBC_STRINGIZE(clang attribute push (__attribute__((target(t))), apply_to = function)))
+#define ICBC_TARGET_END _Pragma("clang attribute pop")
+#elif __GNUC__
+#define ICBC_TARGET_BEGIN(t) _Pragma("GCC push_options") _Pragma(ICBC_STRINGIZE(GCC target(t)))
+#define ICBC_TARGET_END _Pragma("GCC pop_options")
+#else // _MSC_VER emits intrinsics of any instruction set.
+#define ICBC_TARGET_BEGIN(t)
+#define ICBC_TARGET_END
+#endif
+
+#define ICBC_IMPLEMENTATION_ISA
+
+#define ICBC_USE_SPMD ICBC_FLOAT
+#define ICBC_NAMESPACE scalar
+#include ICBC_SELF_INCLUDE
+#undef ICBC_NAMESPACE
+#undef ICBC_USE_SPMD
+
+ICBC_TARGET_BEGIN("sse2")
+#define ICBC_USE_SPMD ICBC_SSE2
+#define ICBC_NAMESPACE sse2
+#include ICBC_SELF_INCLUDE
+#undef ICBC_NAMESPACE
+#undef ICBC_USE_SPMD
+ICBC_TARGET_END
+
+ICBC_TARGET_BEGIN("sse4.1")
+#define ICBC_USE_SPMD ICBC_SSE41
+#define ICBC_NAMESPACE sse41
+#include ICBC_SELF_INCLUDE
+#undef ICBC_NAMESPACE
+#undef ICBC_USE_SPMD
+ICBC_TARGET_END
+
+ICBC_TARGET_BEGIN("avx")
+#define ICBC_USE_SPMD ICBC_AVX1
+#define ICBC_NAMESPACE avx
+#include ICBC_SELF_INCLUDE
+#undef ICBC_NAMESPACE
+#undef ICBC_USE_SPMD
+ICBC_TARGET_END
+
+ICBC_TARGET_BEGIN("avx2,fma")
+#define ICBC_USE_SPMD ICBC_AVX2
+#define ICBC_NAMESPACE avx2
+#include ICBC_SELF_INCLUDE
+#undef ICBC_NAMESPACE
+#undef ICBC_USE_SPMD
+ICBC_TARGET_END
+
+ICBC_TARGET_BEGIN("avx512f,avx2,fma")
+#define ICBC_USE_SPMD ICBC_AVX512
+#define ICBC_NAMESPACE avx512
+#include ICBC_SELF_INCLUDE
+#undef ICBC_NAMESPACE
+#undef ICBC_USE_SPMD
+ICBC_TARGET_END
+
+ICBC_TARGET_BEGIN("avx512f,avx512vl,avx2,fma")
+#define ICBC_USE_SPMD ICBC_AVX512VL
+#define ICBC_NAMESPACE avx512vl
+#include ICBC_SELF_INCLUDE
+#undef ICBC_NAMESPACE
+#undef ICBC_USE_SPMD
+ICBC_TARGET_END
+
+#undef ICBC_IMPLEMENTATION_ISA
+#undef ICBC_TARGET_BEGIN
+#undef ICBC_TARGET_END
+#undef ICBC_STRINGIZE
+
+#else // ICBC_DISPATCH
+
+#define ICBC_IMPLEMENTATION_ISA
+#define ICBC_NAMESPACE spmd
+#include ICBC_SELF_INCLUDE
+#undef ICBC_NAMESPACE
+#undef ICBC_IMPLEMENTATION_ISA
+
+#endif // ICBC_DISPATCH
+
+namespace icbc {
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// Public API
+
+#if ICBC_DISPATCH
+
+static void cpuid(uint32 info[4], uint32 function) {
+#if _MSC_VER
+    __cpuidex((int *)info, int(function), 0);
+#else
+    __cpuid_count(function, 0, info[0], info[1], info[2], info[3]);
+#endif
+}
+
+// Returns the register state enabled by the OS.
+static uint64 xgetbv() {
+#if _MSC_VER
+    return _xgetbv(0);
+#else
+    uint32 eax, edx;
+    __asm__ __volatile__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    return eax | (uint64(edx) << 32);
+#endif
+}
+
+static ISA detect_isa(bool * avx512vl_support) {
+    uint32 info[4];
+    cpuid(info, 0);
+    const uint32 max_function = info[0];
+
+    cpuid(info, 1);
+    const bool sse2 = (info[3] & (1 << 26)) != 0;
+    const bool sse41 = (info[2] & (1 << 19)) != 0;
+    const bool fma = (info[2] & (1 << 12)) != 0;
+    const bool osxsave = (info[2] & (1 << 27)) != 0;
+    const bool avx = (info[2] & (1 << 28)) != 0;
+
+    bool avx2 = false, avx512 = false, avx512vl = false;
+    if (max_function >= 7) {
+        cpuid(info, 7);
+        avx2 = (info[1] & (1 << 5)) != 0;
+        avx512 = (info[1] & (1 << 16)) != 0;
+        avx512vl = (info[1] & (1u << 31)) != 0;
+    }
+
+    // The OS has to save the YMM, and the ZMM and opmask registers.
+    const uint64 xcr0 = osxsave ? xgetbv() : 0;
+    const bool os_avx = (xcr0 & 0x06) == 0x06;
+    const bool os_avx512 = (xcr0 & 0xE6) == 0xE6;
+
+    *avx512vl_support = avx512 && avx512vl && avx2 && fma && os_avx512;
+
+    if (avx512 && avx2 && fma && os_avx512) return ISA_AVX512;
+    if (avx2 && fma && os_avx) return ISA_AVX2;
+    if (avx && os_avx) return ISA_AVX;
+    if (sse41) return ISA_SSE41;
+    if (sse2) return ISA_SSE2;
+    return ISA_Float;
+}
+
+static ISA s_isa = ISA_Float;
+
+#define ICBC_DISPATCH_CALL(call) \
+    switch (s_isa) { \
+        case ISA_AVX512VL: return avx512vl::call; \
+        case ISA_AVX512: return avx512::call; \
+        case ISA_AVX2: return avx2::call; \
+        case ISA_AVX: return avx::call; \
+        case ISA_SSE41: return sse41::call; \
+        case ISA_SSE2: return sse2::call; \
+        default: return scalar::call; \
+    }
+
+#else // ICBC_DISPATCH
+
+static const ISA s_isa = ISA(ICBC_USE_SPMD);
+
+#define ICBC_DISPATCH_CALL(call) return spmd::call
+
+#endif // ICBC_DISPATCH
+
+static void init_dxt1_tables() {
+    ICBC_DISPATCH_CALL(init_dxt1());
+}
+
+ISA init_dxt1(ISA isa/*=ISA_Best*/) {
+#if ICBC_DISPATCH
+    bool avx512vl_support;
+    ISA best_isa = detect_isa(&avx512vl_support);
+    if (isa == ISA_AVX512VL) s_isa = avx512vl_support ? ISA_AVX512VL : min(ISA_AVX512, best_isa);
+    else s_isa = min(isa, best_isa);
+#else
+    (void)isa;
+#endif
+    init_dxt1_tables();
+    return s_isa;
+}
+
+float compress_dxt1(const float input_colors[16 * 4], const float input_weights[16], const float rgb[3], bool three_color_mode, bool hq, void * output) {
+    ICBC_DISPATCH_CALL(compress_dxt1(input_colors, input_weights, rgb, three_color_mode, hq, output));
+}
+
+float compress_dxt1(const unsigned char input_colors[16 * 4], const Options & options, void * output) {
+    ICBC_DISPATCH_CALL(compress_dxt1(input_colors, options, output));
+}
+
+float compress_dxt1_fast(const float input_colors[16 * 4], const float input_weights[16], const float rgb[3], void * output) {
+    ICBC_DISPATCH_CALL(compress_dxt1_fast(input_colors, input_weights, rgb, output));
+}
+
+void compress_dxt1_fast(const unsigned char input_colors[16 * 4], void * output) {
+    ICBC_DISPATCH_CALL(compress_dxt1_fast(input_colors, output));
+}
+
+void compress_dxt1_fast_blocks(int block_count, const unsigned char * input_blocks, void * output) {
+    ICBC_DISPATCH_CALL(compress_dxt1_fast_blocks(block_count, input_blocks, output));
+}
+
+void compress_dxt1_test(const float input_colors[16 * 4], const float input_weights[16], const float rgb[3], void * output) {
+    ICBC_DISPATCH_CALL(compress_dxt1_test(input_colors, input_weights, rgb, output));
+}
+
+void compress_dxt1_image(int width, int height, int row_stride, const unsigned char * rgba8, const Options & options, void * output) {
+    ICBC_DISPATCH_CALL(compress_dxt1_image(width, height, row_stride, rgba8, options, output));
+}
+
+int mipmap_count(int width, int height) {
+    int count = 1;
+    while (width > 1 || height > 1) {
+        width = max(1, width / 2);
+        height = max(1, height / 2);
+        count++;
+    }
+    return count;
+}
+
+int mipmap_block_count(int width, int height) {
+    int block_count = ((width + 3) / 4) * ((height + 3) / 4);
+    while (width > 1 || height > 1) {
+        width = max(1, width / 2);
+        height = max(1, height / 2);
+        block_count += ((width + 3) / 4) * ((height + 3) / 4);
+    }
+    return block_count;
+}
+
+bool compress_dxt1_mipmaps(int width, int height, int row_stride, const unsigned char * rgba8, const Options & options, void * output) {
+    ICBC_DISPATCH_CALL(compress_dxt1_mipmaps(width, height, row_stride, rgba8, options, output));
+}
+
+float compress_bc4(const unsigned char input_values[16], void * output) {
+    ICBC_DISPATCH_CALL(compress_bc4(input_values, output));
+}
+
+float compress_bc5(const unsigned char input_colors[16 * 4], void * output) {
+    ICBC_DISPATCH_CALL(compress_bc5(input_colors, output));
+}
+
+float compress_bc3(const unsigned char input_colors[16 * 4], const Options & options, void * output) {
+    ICBC_DISPATCH_CALL(compress_bc3(input_colors, options, output));
+}
+
+void compress_bc4_image(int width, int height, int row_stride, const unsigned char * rgba8, void * output) {
+    ICBC_DISPATCH_CALL(compress_bc4_image(width, height, row_stride, rgba8, output));
+}
+
+void compress_bc5_image(int width, int height, int row_stride, const unsigned char * rgba8, void * output) {
+    ICBC_DISPATCH_CALL(compress_bc5_image(width, height, row_stride, rgba8, output));
+}
+
+float evaluate_dxt1_error(const unsigned char rgba_block[16 * 4], const void * dxt_block, Decoder decoder/*=Decoder_D3D10*/) {
+    ICBC_DISPATCH_CALL(evaluate_dxt1_error(rgba_block, dxt_block, decoder));
+}
+
+} // icbc
+
+// Do not polute preprocessor definitions.
+#undef ICBC_DISPATCH_CALL
+#undef ICBC_DISPATCH
+#undef ICBC_DECODER
+#undef ICBC_USE_SPMD
+#undef ICBC_USE_PFOR
+#undef ICBC_ASSERT
+
+#endif // ICBC_IMPLEMENTATION_ISA
 
 #endif // ICBC_IMPLEMENTATION
 
@@ -1,13 +1,19 @@
 // Compilation instructions:
-// $ g++ icbc_test.cpp -O3 -mavx2
-// > cl icbc_test.cpp /O2 /arch:AVX2
+// $ g++ icbc_test.cpp -O3
+// > cl icbc_test.cpp /O2
+// Also build it from another directory, e.g. $ g++ icbc/icbc_test.cpp -O3, to check that icbc.h finds itself for each instruction set.
 
-// Enable one of these:
+// The instruction set is selected at runtime, use -isa N to force a lower one. Or enable one of these to build only that one:
 //#define ICBC_USE_SPMD 1         // SSE2
 //#define ICBC_USE_SPMD 2         // SSE4.1
 //#define ICBC_USE_SPMD 3         // AVX
-#define ICBC_USE_SPMD 4         // AVX2
+//#define ICBC_USE_SPMD 4         // AVX2
 //#define ICBC_USE_SPMD 5         // AVX512
+//#define ICBC_USE_SPMD 6         // AVX512VL (AVX-512 on 256 bit registers, only used when requested with -isa 6)
+
+// Include ic_pfor.h first so that icbc::compress_dxt1_image uses it.
+#define IC_PFOR_IMPLEMENTATION
+#include "ic_pfor.h"
 
 #define ICBC_IMPLEMENTATION
 #include "icbc.h"
@@ -16,9 +22,6 @@
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 
-#define IC_PFOR_IMPLEMENTATION
-#include "ic_pfor.h"
-
 
 
 #include <stdio.h>
@@ -135,15 +138,25 @@ struct TimeEstimate {
 
 #define IC_MAKEFOURCC(str) (u32(str[0]) | (u32(str[1]) << 8) | (u32(str[2]) << 16) | (u32(str[3]) << 24 ))
 
-static bool output_dxt_dds(u32 w, u32 h, const u8* data, const char * filename) {
+static u32 dxt_mipmap_size(u32 w, u32 h, u32 level) {
+    w = icbc::max(1U, w >> level);
+    h = icbc::max(1U, h >> level);
+    return 8 * (((w+3)/4) * ((h+3)/4));
+}
+
+// The mipmap levels of data are stored consecutively, from the largest to the smallest.
+static bool output_dxt_dds(u32 w, u32 h, u32 mipmap_count, const u8* data, const char * filename) {
 
     const u32 DDSD_CAPS = 0x00000001;
     const u32 DDSD_PIXELFORMAT = 0x00001000;
     const u32 DDSD_WIDTH = 0x00000004;
     const u32 DDSD_HEIGHT = 0x00000002;
+    const u32 DDSD_MIPMAPCOUNT = 0x00020000;
     const u32 DDSD_LINEARSIZE = 0x00080000;
     const u32 DDPF_FOURCC = 0x00000004;
+    const u32 DDSCAPS_COMPLEX = 0x00000008;
     const u32 DDSCAPS_TEXTURE = 0x00001000;
+    const u32 DDSCAPS_MIPMAP = 0x00400000;
 
     struct DDS {
         u32 fourcc = IC_MAKEFOURCC("DDS ");
@@ -177,7 +190,17 @@ static bool output_dxt_dds(u32 w, u32 h, const u8* data, const char * filename)
 
     dds.width = w;
     dds.height = h;
-    dds.pitch = 8 * (((w+3)/4) * ((h+3)/4)); // linear size
+    dds.pitch = dxt_mipmap_size(w, h, 0); // linear size
+    dds.mipmapcount = mipmap_count;
+    if (mipmap_count > 1) {
+        dds.flags |= DDSD_MIPMAPCOUNT;
+        dds.caps.caps1 |= DDSCAPS_COMPLEX | DDSCAPS_MIPMAP;
+    }
+
+    u32 data_size = 0;
+    for (u32 m = 0; m < mipmap_count; m++) {
+        data_size += dxt_mipmap_size(w, h, m);
+    }
 
     FILE * fp = fopen(filename, "wb");
     if (fp == nullptr) return false;
@@ -186,14 +209,14 @@ static bool output_dxt_dds(u32 w, u32 h, const u8* data, const char * filename)
     fwrite(&dds, sizeof(dds), 1, fp);
 
     // Write dxt data:
-    fwrite(data, dds.pitch, 1, fp);
+    fwrite(data, data_size, 1, fp);
 
     fclose(fp);
 
     return true;
 }
 
-static bool output_dxt_ktx(u32 w, u32 h, const u8* data, const char * filename) {
+static bool output_dxt_ktx(u32 w, u32 h, u32 mipmap_count, const u8* data, const char * filename) {
 
     const u32 GL_COMPRESSED_RGB_S3TC_DXT1_EXT = 0x83F0;
     const u32 GL_RGBA = 0x1908;
@@ -222,19 +245,21 @@ static bool output_dxt_ktx(u32 w, u32 h, const u8* data, const char * filename)
     ktx.pixelWidth = w;
     ktx.pixelHeight = h;
     ktx.numberOfFaces = 1;
-    ktx.numberOfMipmapLevels = 1;
-
-    u32 image_size = 8 * ((w+3)/4 * (h+3)/4);
+    ktx.numberOfMipmapLevels = mipmap_count;
 
     FILE * fp = fopen(filename, "wb");
     if (fp == nullptr) return false;
 
     // Write header:
     fwrite(&ktx, sizeof(ktx), 1, fp);
-    fwrite(&image_size, sizeof(u32), 1, fp);
 
-    // Write dxt data:
-    fwrite(data, image_size, 1, fp);
+    // Write dxt data, DXT1 levels are multiples of 8 bytes, so they don't need padding:
+    for (u32 m = 0; m < mipmap_count; m++) {
+        u32 image_size = dxt_mipmap_size(w, h, m);
+        fwrite(&image_size, sizeof(u32), 1, fp);
+        fwrite(data, image_size, 1, fp);
+        data += image_size;
+    }
 
     fclose(fp);
 
@@ -269,6 +294,8 @@ static float mse_to_psnr(float mse) {
 bool output_dds = false;
 bool output_ktx = false;
 int repeat_count = 1;
+icbc::ISA isa = icbc::ISA_Best;
+icbc::Quality quality = icbc::Quality_Default;
 
 // Output stats:
 int total_block_count = 0;
@@ -287,39 +314,33 @@ bool encode_image(const char * input_filename) {
         return false;
     }
 
-    int block_count = (w / 4) * (h / 4);
+    int bw = (w + 3) / 4;
+    int bh = (h + 3) / 4;
+    int block_count = bw * bh;
+
+    // Convert to block layout for error evaluation, replicating edge texels like the encoder does.
     u8 * rgba_block_data = (u8 *)malloc(block_count * 4 * 4 * 4);
     defer { free(rgba_block_data); };
 
-    int bw = 4 * (w / 4); // @@ Round down.
-    int bh = 4 * (h / 4);
-
-    // Convert to block layout.
-    for (int y = 0, b = 0; y < bh; y += 4) {
-        for (int x = 0; x < bw; x += 4, b++) {
+    for (int by = 0, b = 0; by < bh; by++) {
+        for (int bx = 0; bx < bw; bx++, b++) {
             for (int yy = 0; yy < 4; yy++) {
                 for (int xx = 0; xx < 4; xx++) {
-                    if (x + xx < w && y + yy < h) {
-                        rgba_block_data[b * 4 * 4 * 4 + (yy * 4 + xx) * 4 + 0] = input_data[((y + yy) * w + x + xx) * 4 + 0];
-                        rgba_block_data[b * 4 * 4 * 4 + (yy * 4 + xx) * 4 + 1] = input_data[((y + yy) * w + x + xx) * 4 + 1];
-                        rgba_block_data[b * 4 * 4 * 4 + (yy * 4 + xx) * 4 + 2] = input_data[((y + yy) * w + x + xx) * 4 + 2];
-                        rgba_block_data[b * 4 * 4 * 4 + (yy * 4 + xx) * 4 + 3] = input_data[((y + yy) * w + x + xx) * 4 + 3];
-                    }
-                    else {
-                        rgba_block_data[b * 4 * 4 * 4 + (yy * 4 + xx) * 4 + 0] = 0;
-                        rgba_block_data[b * 4 * 4 * 4 + (yy * 4 + xx) * 4 + 1] = 0;
-                        rgba_block_data[b * 4 * 4 * 4 + (yy * 4 + xx) * 4 + 2] = 0;
-                        rgba_block_data[b * 4 * 4 * 4 + (yy * 4 + xx) * 4 + 3] = 0;
-                    }
+                    int x = icbc::min(4 * bx + xx, w - 1);
+                    int y = icbc::min(4 * by + yy, h - 1);
+                    memcpy(&rgba_block_data[b * 4 * 4 * 4 + (yy * 4 + xx) * 4], &input_data[(y * w + x) * 4], 4);
                 }
             }
         }
     }
 
-    //const float color_weights[3] = {3, 4, 2}; // This is probably better for color images.
-    const float color_weights[3] = {1, 1, 1};
+    icbc::Options options;
+    //options.color_weights[0] = 3; options.color_weights[1] = 4; options.color_weights[2] = 2; // This is probably better for color images.
+    options.three_color_mode = true;
+    options.quality = quality;
 
     u8 * block_data = (u8 *)malloc(block_count * 8);
+    defer { free(block_data); };
 
     printf("Encoding '%s':", input_filename);
 
@@ -329,35 +350,33 @@ bool encode_image(const char * input_filename) {
 
         timer.start();
 
-        //ic::pfor(block_count, 32, [=](int b) {
-        ic_pfor(b, block_count, 32) {
-            float input_colors[16 * 4];
-            float input_weights[16];
-            for (int j = 0; j < 16; j++) {
-                input_colors[4 * j + 0] = rgba_block_data[b * 4 * 4 * 4 + j * 4 + 0] / 255.0f;
-                input_colors[4 * j + 1] = rgba_block_data[b * 4 * 4 * 4 + j * 4 + 1] / 255.0f;
-                input_colors[4 * j + 2] = rgba_block_data[b * 4 * 4 * 4 + j * 4 + 2] / 255.0f;
-                input_colors[4 * j + 3] = 1.0f;
-                input_weights[j] = 1.0f;
-            }
-
-            icbc::compress_dxt1(input_colors, input_weights, color_weights, /*three_color_mode=*/true, /*hq=*/false, (block_data + b * 8));
-        };
-        //});
+        icbc::compress_dxt1_image(w, h, w * 4, input_data, options, block_data);
 
         estimate.add(timer.stop());
     }
 
     float mse = evaluate_dxt1_mse(rgba_block_data, block_data, block_count);
 
-    char output_filename[1024];
-    if (output_dds) {
-        snprintf(output_filename, 1024, "%.*s_bc1.dds", int(strchr(input_filename, '.')-input_filename), input_filename);
-        output_dxt_dds(bw, bh, block_data, output_filename);
-    }
-    if (output_ktx) {
-        snprintf(output_filename, 1024, "%.*s_bc1.ktx", int(strchr(input_filename, '.')-input_filename), input_filename);
-        output_dxt_ktx(bw, bh, block_data, output_filename);
+    if (output_dds || output_ktx) {
+        // Output files have the full mipmap chain.
+        int mipmap_count = icbc::mipmap_count(w, h);
+        u8 * mipmap_data = (u8 *)malloc(icbc::mipmap_block_count(w, h) * 8);
+        defer { free(mipmap_data); };
+
+        if (!icbc::compress_dxt1_mipmaps(w, h, w * 4, input_data, options, mipmap_data)) {
+            printf("Failed to allocate the mipmap buffers of '%s'.\n", input_filename);
+            return false;
+        }
+
+        char output_filename[1024];
+        if (output_dds) {
+            snprintf(output_filename, 1024, "%.*s_bc1.dds", int(strchr(input_filename, '.')-input_filename), input_filename);
+            output_dxt_dds(w, h, mipmap_count, mipmap_data, output_filename);
+        }
+        if (output_ktx) {
+            snprintf(output_filename, 1024, "%.*s_bc1.ktx", int(strchr(input_filename, '.')-input_filename), input_filename);
+            output_dxt_ktx(w, h, mipmap_count, mipmap_data, output_filename);
+        }
     }
 
     total_block_count += block_count;
@@ -410,12 +429,21 @@ int main(int argc, char * argv[]) {
         else if (strcmp(argv[i], "-ktx") == 0) {
             output_ktx = true;
         }
+        else if (strcmp(argv[i], "-q") == 0 && i + 1 < argc) {
+            quality = (icbc::Quality)icbc::clamp(atoi(argv[++i]), 0, int(icbc::Quality_Max));
+        }
+        else if (strcmp(argv[i], "-isa") == 0 && i + 1 < argc) {
+            isa = (icbc::ISA)icbc::clamp(atoi(argv[++i]), 0, int(icbc::ISA_Best));
+        }
         else if (atoi(argv[i])) {
             repeat_count = atoi(argv[i]);
         }
     }
 
-    icbc::init_dxt1();
+    static const char * isa_names[] = { "FLOAT", "SSE2", "SSE4.1", "AVX", "AVX2", "AVX512", "AVX512VL" };
+    int isa_index = icbc::init_dxt1(isa);
+    printf("Using %s.\n", isa_index >= 0 ? isa_names[isa_index] : "NEON");
+
     int thread_count = ic::init_pfor();
     printf("Using %d threads.\n", thread_count);
 